@@ -12,18 +12,58 @@
 
 #include <minix/drivers.h>
 #include <minix/netdriver.h>
+#include <minix/ds.h>
 #include <machine/pci.h>
 #include "sge.h"
 
 static int sge_instance;
+static int sge_pci_done;
 static sge_t sge_state;
+static sge_t sge_peer;
+
+/* Bus tuning per model; the last entry covers anything else. */
+static const sge_tune_t sge_tune[] =
+{
+	{ SGE_DEV_0190, SGE_CACHELINE, 64, 1, 0x00001c00, 0x001e1c00 },
+	{ SGE_DEV_0191, SGE_CACHELINE, 64, 1, 0x00001c00, 0x001e1c00 },
+	{ 0,            0,             0,  0, 0x00001c00, 0x001e1c00 },
+};
+
+/*
+ * Tag MMIO accesses with the event being served. The event is the
+ * process's, so accesses to the second port are tagged from sge_state.
+ */
+#if SGE_MMIO_STATS
+#define SGE_MMIO_CTX(e, ctx)	((e)->mmio_ctx = (ctx))
+#else
+#define SGE_MMIO_CTX(e, ctx)
+#endif
+
+/* Tests on compiled out features fold to constants. */
+#if SGE_PKTGEN
+#define SGE_PG_ACTIVE(e)	((e)->pg_active)
+#else
+#define SGE_PG_ACTIVE(e)	0
+#endif
+#if SGE_RX_DWELL
+#define SGE_DWELL_ON(e)	((e)->dwell_on)
+#else
+#define SGE_DWELL_ON(e)	0
+#endif
 
 static void sge_init(message *mp);
 static void sge_init_pci(void);
 static int sge_probe(sge_t *e, int skip);
+static void sge_pci_tune(sge_t *e);
 static int sge_init_hw(sge_t *e);
 static void sge_init_addr(sge_t *e);
 static void sge_init_buf(sge_t *e);
+static void sge_init_services(sge_t *e);
+static int sge_phy_restore(sge_t *e, int addr, uint16_t id0, uint16_t id1);
+static void sge_ckpt_save(sge_t *e);
+static int sge_ckpt_restore(sge_t *e);
+static void sge_init_rx_ring(sge_t *e);
+static void sge_init_tx_ring(sge_t *e);
 static void sge_reset_hw(sge_t *e);
 static void sge_interrupt(message *mp);
 static void sge_stop(sge_t *e);
@@ -36,7 +76,65 @@ static int sge_mii_probe(sge_t *e);
 static uint16_t sge_mii_read(sge_t *e, uint32_t phy, uint32_t reg);
 static void sge_mii_write(sge_t *e, uint32_t phy, uint32_t reg, uint32_t data);
 static void sge_writev_s(message *mp, int from_int);
+static int sge_tx_admit(sge_t *e);
+static size_t sge_tx_copy(sge_t *e, char *buf);
+static void sge_tx_post(sge_t *e, size_t len, int origin);
+static int sge_tx_classify(sge_t *e, uint8_t *buf, size_t len);
+static int sge_tx_enqueue(sge_t *e, char *buf, size_t len, int prio);
+static void sge_init_prio(sge_t *e);
+static void sge_fc_resolve(sge_t *e);
+static int sge_fc_send(sge_t *e, uint16_t quanta);
+static int sge_fc_recv(sge_t *e, uint8_t *buf, size_t len);
+static void sge_fc_pressure(sge_t *e);
+static int sge_tx_paused(sge_t *e);
+static sge_t *sge_lag_pick(sge_t *e, uint8_t *buf, size_t len);
+static uint32_t sge_lag_hash(int layers, uint8_t *buf, size_t len);
+static void sge_lag_link(sge_t *p);
+static uint32_t sge_intr_ack(sge_t *p);
+static void sge_intr_recover(sge_t *p, uint32_t status);
+static void sge_rx_drain(sge_t *e, sge_t *p);
+static void sge_ring_stage(sge_t *e, uint32_t status, uint32_t peer);
+static void sge_client_stage(sge_t *e, uint32_t events);
+static void sge_intr_enable(sge_t *e);
+static uint32_t sge_tx_csum(uint8_t *frame, size_t len);
+static void sge_caps_publish(sge_t *e);
+static void sge_tx_reclaim(sge_t *e);
+static void sge_tx_flush(sge_t *e);
+#if SGE_PKTGEN
+static void sge_pktgen_start(sge_t *e);
+static void sge_pktgen_run(sge_t *e);
+static void sge_pktgen_fill(sge_t *e);
+#endif
+#if SGE_SELFTEST
+static void sge_selftest(sge_t *e);
+static int sge_selftest_send(sge_t *e, uint32_t seq);
+static int sge_selftest_recv(sge_t *e, uint32_t *seq, uint64_t *stamp,
+	uint64_t deadline);
+#endif
+#if SGE_SELFTEST || SGE_RX_DWELL
+static void sge_percentiles(uint64_t *v, int n, uint64_t *pct);
+static int sge_cmp_u64(const void *a, const void *b);
+#endif
+static void sge_tx_recover(sge_t *e);
+static void sge_tx_watchdog(sge_t *e);
+static void sge_rx_recover(sge_t *e);
 static void sge_readv_s(message *mp, int from_int);
+static void sge_rx_copy(sge_t *e, char *buf, size_t len, uint32_t status,
+	uint64_t seen);
+#if SGE_RX_DWELL
+static int sge_rx_stamp(sge_t *e, size_t off, uint64_t stamp);
+static void sge_rx_mark(sge_t *e);
+static void sge_rx_dwell(sge_t *e);
+#endif
+static int sge_rx_csum(sge_t *e, uint32_t status);
+static void sge_iovec_fetch(sge_t *e, message *mp, cp_grant_id_t grant,
+	int count, iovec_s_t *iovec);
+static void sge_rx_rearm(sge_t *e, uint32_t current);
+static void sge_rx_harvest(sge_t *e);
+static sge_desc_t *sge_rx_next(sge_t *e);
+static int sge_rx_check(sge_t *e, uint32_t info);
+static int sge_rx_vlan(sge_t *e, sge_desc_t *desc, uint8_t *buf);
+static void sge_init_vlan(sge_t *e);
 static void sge_getstat_s(message *mp);
 static uint16_t sge_default_phy(sge_t *e);
 static uint16_t sge_reset_phy(sge_t *e, uint32_t addr);
@@ -44,11 +142,34 @@ static void sge_phymode(sge_t *e);
 static void sge_macmode(sge_t *e);
 static void reply(sge_t *e);
 static void mess_reply(message *req, message *reply);
+static void sge_request(message *m);
+static void sge_fkey(message *m);
 static void sge_dump(message *m);
+static void sge_dump_step(sge_t *e);
+static void sge_alarm(sge_t *e);
+static void sge_tick(sge_t *e);
+static void sge_sample(sge_t *e);
+static long sge_env(char *name, long def, long min, long max);
+static void sge_statpage_init(sge_t *e);
+static void sge_statpage_update(sge_t *e);
+#if SGE_CAPTURE
+static void sge_capture_init(sge_t *e);
+static void sge_capture(sge_t *e, char *buf, size_t len);
+#endif
+#if SGE_MMIO_STATS
+static void sge_mmio_dump(sge_t *e);
+#endif
 
 /* SEF functions and variables. */
 static void sef_local_startup(void);
 static int sef_cb_init_fresh(int type, sef_init_info_t *info);
+static int sef_cb_init_lu(int type, sef_init_info_t *info);
+static int sef_cb_init_restart(int type, sef_init_info_t *info);
+static void sef_init_conf(void);
+static int sef_cb_lu_prepare(int state);
+static int sef_cb_lu_state_isvalid(int state);
+static int sef_cb_lu_state_save(int state);
+static int sge_lu_restore(sge_t *e);
 static void sef_cb_signal_handler(int signo);
 
 /*===========================================================================*
@@ -80,28 +201,56 @@ int main(int argc, char *argv[])
 			switch (_ENDPOINT_P(m.m_source))
 			{
 			case HARDWARE:
+				SGE_MMIO_CTX(&sge_state, SGE_CTX_INTR);
 				sge_interrupt(&m);
 				break;
 			case CLOCK:
+				SGE_MMIO_CTX(&sge_state, SGE_CTX_MGMT);
+				sge_tick(&sge_state);
 				break;
 			case TTY_PROC_NR:
-				sge_dump(&m);
+				SGE_MMIO_CTX(&sge_state, SGE_CTX_MGMT);
+				sge_fkey(&m);
 				break;
 			}
-			continue;
 		}
-		switch (m.m_type)
+		else
+		{
+			sge_request(&m);
+		}
+
+		/* Print a slice of a pending dump, between events. */
+		if (sge_state.dump_step != SGE_DUMP_IDLE)
 		{
-		case DL_CONF:       sge_init(&m);               break;
-		case DL_GETSTAT_S:  sge_getstat_s(&m);          break;
-		case DL_WRITEV_S:   sge_writev_s(&m, FALSE);    break;
-		case DL_READV_S:    sge_readv_s(&m, FALSE);     break;
-		default:
-			panic("illegal message: %d", m.m_type);
+			SGE_MMIO_CTX(&sge_state, SGE_CTX_MGMT);
+			sge_dump_step(&sge_state);
 		}
 	}
 }
 
+/*===========================================================================*
+ *                              sge_request                                  *
+ *===========================================================================*/
+static void sge_request(m)
+message *m;
+{
+	switch (m->m_type)
+	{
+	case DL_WRITEV_S:   SGE_MMIO_CTX(&sge_state, SGE_CTX_TX);   break;
+	case DL_READV_S:    SGE_MMIO_CTX(&sge_state, SGE_CTX_RX);   break;
+	default:            SGE_MMIO_CTX(&sge_state, SGE_CTX_MGMT); break;
+	}
+	switch (m->m_type)
+	{
+	case DL_CONF:       sge_init(m);                break;
+	case DL_GETSTAT_S:  sge_getstat_s(m);           break;
+	case DL_WRITEV_S:   sge_writev_s(m, FALSE);     break;
+	case DL_READV_S:    sge_readv_s(m, FALSE);      break;
+	default:
+		panic("illegal message: %d", m->m_type);
+	}
+}
+
 /*===========================================================================*
  *                          sef_local_startup                                *
  *===========================================================================*/
@@ -109,12 +258,13 @@ static void sef_local_startup()
 {
 	/* Register init callbacks. */
 	sef_setcb_init_fresh(sef_cb_init_fresh);
-	sef_setcb_init_lu(sef_cb_init_fresh);
-	sef_setcb_init_restart(sef_cb_init_fresh);
+	sef_setcb_init_lu(sef_cb_init_lu);
+	sef_setcb_init_restart(sef_cb_init_restart);
 
 	/* Register live update callbacks. */
-	sef_setcb_lu_prepare(sef_cb_lu_prepare_always_ready);
-	sef_setcb_lu_state_isvalid(sef_cb_lu_state_isvalid_workfree);
+	sef_setcb_lu_prepare(sef_cb_lu_prepare);
+	sef_setcb_lu_state_isvalid(sef_cb_lu_state_isvalid);
+	sef_setcb_lu_state_save(sef_cb_lu_state_save);
 
 	/* Register signal callbacks. */
 	sef_setcb_signal_handler(sef_cb_signal_handler);
@@ -129,14 +279,57 @@ static void sef_local_startup()
 static int sef_cb_init_fresh(int UNUSED(type), sef_init_info_t *UNUSED(info))
 {
 	/* Initialize the SiS FE Driver. */
+	sef_init_conf();
+
+	/* Announce we are up! */
+	netdriver_announce();
+
+	return(OK);
+}
+
+/*===========================================================================*
+ *                            sef_cb_init_lu                                 *
+ *===========================================================================*/
+static int sef_cb_init_lu(int UNUSED(type), sef_init_info_t *UNUSED(info))
+{
+	/* Take over the card from the previous instance. */
+	sef_init_conf();
+
+	/* Without its state, start over as if fresh. */
+	if (!sge_lu_restore(&sge_state))
+		netdriver_announce();
+
+	return(OK);
+}
+
+/*===========================================================================*
+ *                          sef_cb_init_restart                              *
+ *===========================================================================*/
+static int sef_cb_init_restart(int UNUSED(type), sef_init_info_t *UNUSED(info))
+{
+	/* As fresh, but trust our checkpoint if the card still agrees. */
+	sef_init_conf();
+	sge_state.restarted = TRUE;
+
+	netdriver_announce();
+
+	return(OK);
+}
+
+/*===========================================================================*
+ *                             sef_init_conf                                 *
+ *===========================================================================*/
+static void sef_init_conf()
+{
 	int r, fkeys, sfkeys;
 	long v;
 
-	/* Request function key for debug dumps */
+	/* Request function keys for debug dumps and the packet generator */
 	fkeys = sfkeys = 0;
 	bit_set(sfkeys, 7);
+	bit_set(sfkeys, 8);
 	if ((r = fkey_map(&fkeys, &sfkeys)) != OK)
-		printf("sge: couldn't bind Shift+F7 key (%d)\n", r);
+		printf("sge: couldn't bind Shift+F7/F8 keys (%d)\n", r);
 
 	v = 0;
 	(void)env_parse("instance", "d", 0, &v, 0, 255);
@@ -145,10 +338,261 @@ static int sef_cb_init_fresh(int UNUSED(type), sef_init_info_t *UNUSED(info))
 	/* Clear state. */
 	memset(&sge_state, 0, sizeof(sge_state));
 
-	/* Announce we are up! */
-	netdriver_announce();
+	/* Rate sampling period, in milliseconds (0 disables). */
+	v = sge_env("sample_ms", SGE_SAMPLE_MS, 0, 60000);
+	sge_state.sample_ticks = (v * sys_hz()) / 1000;
+	if (v && !sge_state.sample_ticks)
+		sge_state.sample_ticks = 1;
+	sge_state.poll_ticks = (SGE_POLL_MS * sys_hz()) / 1000;
 
-	return(OK);
+	/* Ring geometry. */
+	sge_state.rx_desc_nr = sge_env("rxdesc", SGE_RXDESC_NR, 2, SGE_DESC_MAX);
+	sge_state.tx_desc_nr = sge_env("txdesc", SGE_TXDESC_NR, 2, SGE_DESC_MAX);
+
+	/* Frames staged in software while no read is pending. */
+	sge_state.rxq_depth = sge_env("rxqueue", SGE_RXQ_NR, 0, 4096);
+
+	/* Frames accepted from the client but not yet on the ring. */
+	sge_state.txq_depth = sge_env("txqueue", SGE_TXQ_NR, 0, 4096);
+
+	/*
+	 * Checksum offload. TX is opt-in: it only pays off for a client that
+	 * reads sge<instance>.caps and leaves its checksums to us.
+	 */
+	if (sge_env("txcsum", 0, 0, 1))
+		sge_state.caps |= SGE_CAP_TXCSUM;
+	if (sge_env("rxcsum", 1, 0, 1))
+		sge_state.caps |= SGE_CAP_RXCSUM;
+
+	sge_init_vlan(&sge_state);
+	sge_init_prio(&sge_state);
+
+#if SGE_RX_DWELL
+	/* RX dwell time accounting, and stamps for the client. */
+	sge_state.dwell_on = sge_env("rxdwell", 1, 0, 1);
+	if (sge_env("rxstamp", 0, 0, 1))
+	{
+		sge_state.dwell_on = TRUE;
+		sge_state.caps |= SGE_CAP_RXSTAMP;
+	}
+#endif
+
+	/* 802.3x flow control to advertise. */
+	sge_state.fc_mode = sge_env("fc", SGE_FC_OFF, SGE_FC_OFF, SGE_FC_BOTH);
+
+	/* PCI and DMA tuning; -1 takes the default for the model. */
+	sge_state.pci_cls = sge_env("pci_cls", -1, -1, 255 * 4);
+	sge_state.pci_latency = sge_env("pci_latency", -1, -1, 255);
+	sge_state.pci_mwi = sge_env("pci_mwi", -1, -1, 1);
+	v = -1;
+	(void)env_parse("dma_tx", "x", 0, &v, 0, 0x7fffffff);
+	sge_state.dma_tx_ctl = v;
+	v = -1;
+	(void)env_parse("dma_rx", "x", 0, &v, 0, 0x7fffffff);
+	sge_state.dma_rx_ctl = v;
+
+	/* Give the card its descriptors back before copying to clients. */
+	sge_state.pipeline = sge_env("pipeline", SGE_PIPELINE, 0, 1);
+
+	/* Aggregate with the next port; its frames meet ours in the RX queue. */
+	sge_state.lag_hash = sge_env("lag", SGE_LAG_OFF, SGE_LAG_OFF, SGE_LAG_L4);
+	if (sge_state.lag_hash && sge_state.rxq_depth == 0)
+		sge_state.rxq_depth = SGE_RXQ_NR;
+
+	/* The pipeline hands frames over through the RX queue. */
+	if (sge_state.pipeline && sge_state.rxq_depth == 0)
+	{
+		printf("sge: pipeline needs an RX queue, ignored with rxqueue=0\n");
+		sge_state.pipeline = FALSE;
+	}
+
+#if SGE_PKTGEN
+	/* Packet generator, started with Shift+F8. */
+	sge_state.pg_count = sge_env("pktgen_count", SGE_PKTGEN_COUNT, 1,
+		0x7fffffff);
+	sge_state.pg_size = sge_env("pktgen_size", ETH_MIN_PACK_SIZE,
+		ETH_MIN_PACK_SIZE, ETH_MAX_PACK_SIZE);
+	sge_state.pg_rate = sge_env("pktgen_rate", 0, 0, 10000000);
+#endif
+
+#if SGE_SELFTEST
+	/* PHY loopback self-test at start, with this many frames. */
+	sge_state.selftest_nr = sge_env("selftest", 0, 0, SGE_SELFTEST_MAX);
+#endif
+}
+
+/*===========================================================================*
+ *                           sef_cb_lu_prepare                               *
+ *===========================================================================*/
+static int sef_cb_lu_prepare(int state)
+{
+	sge_t *e = &sge_state;
+
+	if (state != SEF_LU_STATE_WORK_FREE)
+		return ENOTREADY;
+	if (!(e->status & SGE_ENABLED))
+		return OK;
+
+	/*
+	 * Let in-flight work drain first: the rings and queues live in
+	 * memory the new instance cannot inherit. A pending read is carried
+	 * over, but nothing may be left half done. Received frames are not
+	 * waited for, as that would wait on the client; they are dropped
+	 * and counted at save.
+	 */
+	sge_tx_reclaim(e);
+	if (e->peer)
+		sge_tx_reclaim(e->peer);
+	if (e->tx_inuse || (e->peer && e->peer->tx_inuse) ||
+		e->txq_tail != e->txq_head ||
+		e->prioq_tail != e->prioq_head || (e->status & SGE_WRITING) ||
+		SGE_PG_ACTIVE(e) || e->dump_step != SGE_DUMP_IDLE)
+	{
+		return ENOTREADY;
+	}
+
+	return OK;
+}
+
+/*===========================================================================*
+ *                        sef_cb_lu_state_isvalid                            *
+ *===========================================================================*/
+static int sef_cb_lu_state_isvalid(int state)
+{
+	/* We only know how to hand over once drained. */
+	return (state == SEF_LU_STATE_WORK_FREE);
+}
+
+/*===========================================================================*
+ *                         sef_cb_lu_state_save                              *
+ *===========================================================================*/
+static int sef_cb_lu_state_save(int UNUSED(state))
+{
+	sge_t *e = &sge_state;
+	sge_lu_state_t lu;
+	char key[DS_MAX_KEYLEN];
+	int r;
+
+	if (!(e->status & SGE_ENABLED) || e->mii == NULL)
+		return OK;
+
+	/* Quiesce DMA; our rings go away with us. MAC and PHY stay up. */
+	sge_reg_write(e, SGE_REG_INTRMASK, 0);
+	sge_reg_unset(e, SGE_REG_TX_CTL, 0x1);
+	sge_reg_unset(e, SGE_REG_RX_CTL, 0x1);
+
+	/* An aggregate is brought up from scratch by the new instance. */
+	if (e->peer)
+	{
+		sge_reg_write(e->peer, SGE_REG_INTRMASK, 0);
+		sge_reg_unset(e->peer, SGE_REG_TX_CTL, 0x1);
+		sge_reg_unset(e->peer, SGE_REG_RX_CTL, 0x1);
+		return OK;
+	}
+
+	/* Staged frames, and those still on the ring, are lost. */
+	e->stats.rx_lu_drop += e->rxq_tail - e->rxq_head;
+	e->rxq_head = e->rxq_tail;
+	while (sge_rx_next(e) != NULL)
+	{
+		sge_rx_rearm(e, e->cur_rx);
+		e->stats.rx_lu_drop++;
+	}
+
+	memset(&lu, 0, sizeof(lu));
+	lu.magic = SGE_LU_MAGIC;
+	lu.size = sizeof(lu);
+	lu.status = e->status & SGE_READING;
+	lu.flags = e->flags;
+	lu.client = e->client;
+	lu.rx_message = e->rx_message;
+	lu.address = e->address;
+	lu.phy_addr = e->cur_phy;
+	lu.phy_id0 = e->mii->id0;
+	lu.phy_id1 = e->mii->id1;
+	lu.link_speed = e->link_speed;
+	lu.duplex_mode = e->duplex_mode;
+	lu.autoneg_done = e->autoneg_done;
+	lu.stats = e->stats;
+
+	snprintf(key, sizeof(key), SGE_LU_KEY, sge_instance);
+	if ((r = ds_publish_mem(key, &lu, sizeof(lu), DSF_OVERWRITE)) != OK)
+		printf("%s: failed to save state: %d\n", e->name, r);
+
+	return r;
+}
+
+/*===========================================================================*
+ *                             sge_lu_restore                                *
+ *===========================================================================*/
+static int sge_lu_restore(e)
+sge_t *e;
+{
+	sge_lu_state_t lu;
+	char key[DS_MAX_KEYLEN];
+	size_t len = sizeof(lu);
+	int r;
+
+	snprintf(key, sizeof(key), SGE_LU_KEY, sge_instance);
+	if (ds_retrieve_mem(key, (char *) &lu, &len) != OK)
+		return FALSE;
+	(void)ds_delete_mem(key);
+	if (len != sizeof(lu) || lu.magic != SGE_LU_MAGIC ||
+		lu.size != sizeof(lu))
+	{
+		printf("sge#%d: live update state mismatch, starting over\n",
+			sge_instance);
+		return FALSE;
+	}
+
+	/* Map the card again; mappings do not survive the old instance. */
+	pci_init();
+	strlcpy(e->name, "sge#0", sizeof(e->name));
+	e->name[4] += sge_instance;
+	if (!sge_probe(e, sge_instance))
+		return FALSE;
+	sge_pci_done = TRUE;
+
+	if (!sge_phy_restore(e, lu.phy_addr, lu.phy_id0, lu.phy_id1))
+	{
+		printf("%s: PHY changed across live update\n", e->name);
+		return FALSE;
+	}
+	e->address = lu.address;
+	e->flags = lu.flags;
+	e->link_speed = lu.link_speed;
+	e->duplex_mode = lu.duplex_mode;
+	e->autoneg_done = lu.autoneg_done;
+	e->stats = lu.stats;
+	sge_fc_resolve(e);
+
+	/* Neither does DMA memory: fresh rings, pointed at by the card. */
+	sge_init_buf(e);
+
+	e->status = SGE_ENABLED;
+	e->irq_hook = e->irq;
+	if ((r = sys_irqsetpolicy(e->irq, 0, &e->irq_hook)) != OK)
+		panic("sys_irqsetpolicy failed: %d", r);
+	if ((r = sys_irqenable(&e->irq_hook)) != OK)
+		panic("sys_irqenable failed: %d", r);
+
+	sge_reg_write(e, SGE_REG_INTRSTATUS, 0xffffffff);
+	sge_reg_write(e, SGE_REG_INTRMASK, SGE_INTR_MASK(e));
+	sge_reg_set(e, SGE_REG_TX_CTL, 0x1);
+	sge_reg_set(e, SGE_REG_RX_CTL, 0x1 | 0x10);
+
+	sge_init_services(e);
+	sge_ckpt_save(e);
+
+	/* Carry on with the client's pending read. */
+	e->client = lu.client;
+	e->rx_message = lu.rx_message;
+	e->status |= lu.status;
+
+	printf("%s: live update, resumed at %d Mbps %s-duplex\n", e->name,
+		e->link_speed, e->duplex_mode ? "full" : "half");
+
+	return TRUE;
 }
 
 /*===========================================================================*
@@ -157,11 +601,19 @@ static int sef_cb_init_fresh(int UNUSED(type), sef_init_info_t *UNUSED(info))
 static void sef_cb_signal_handler(int signo)
 {
 	sge_t *e;
+	char key[DS_MAX_KEYLEN];
+
 	e = &sge_state;
 
 	/* Only check for termination signal, ignore anything else. */
 	if (signo != SIGTERM) return;
 
+	/* A clean stop leaves nothing to restart from. */
+	snprintf(key, sizeof(key), SGE_CKPT_KEY, sge_instance);
+	(void)ds_delete_mem(key);
+
+	if (e->peer)
+		sge_reset_hw(e->peer);
 	sge_stop(e);
 }
 
@@ -170,14 +622,13 @@ static void sef_cb_signal_handler(int signo)
  *===========================================================================*/
 static void sge_init(message *mp)
 {
-	static int first_time = 1;
 	message reply_mess;
 	sge_t *e;
 
 	/* Configure PCI devices, if needed. */
-	if (first_time)
+	if (!sge_pci_done)
 	{
-		first_time = 0;
+		sge_pci_done = TRUE;
 		sge_init_pci();
 	}
 	e = &sge_state;
@@ -198,6 +649,17 @@ static void sge_init(message *mp)
 		mess_reply(mp, &reply_mess);
 		return;
 	}
+	if (e->peer && !(e->peer->status & SGE_ENABLED))
+	{
+		e->peer->flags = e->flags;
+		if (sge_init_hw(e->peer) != TRUE)
+		{
+			/* Keep flows off a port that never came up. */
+			printf("%s: second port failed to start, not aggregating\n",
+				e->name);
+			e->peer = NULL;
+		}
+	}
 	/* Reply back to INET. */
 	reply_mess.m_type  = DL_CONF_REPLY;
 	reply_mess.m_netdrv_net_dl_conf.stat = OK;
@@ -211,7 +673,7 @@ static void sge_init(message *mp)
  *===========================================================================*/
 static void sge_init_pci()
 {
-	sge_t *e;
+	sge_t *e, *p;
 
 	/* Initialize the PCI bus. */
 	pci_init();
@@ -221,6 +683,28 @@ static void sge_init_pci()
 	strlcpy(e->name, "sge#0", sizeof(e->name));
 	e->name[4] += sge_instance;
 	sge_probe(e, sge_instance);
+
+	if (e->lag_hash)
+	{
+		/*
+		 * The second port is the next device. It shares our settings,
+		 * but not the client, the software queues or the extras.
+		 */
+		p = &sge_peer;
+		*p = *e;
+		p->lag_peer = TRUE;
+		p->rxq_depth = p->txq_depth = 0;
+		p->prio_on = FALSE;
+		p->prio_reserve = 0;
+		p->fc_mode = SGE_FC_OFF;
+		p->selftest_nr = 0;
+		p->restarted = FALSE;
+		p->name[4] += 1;
+		if (sge_probe(p, sge_instance + 1))
+			e->peer = p;
+		else
+			printf("%s: no second port, not aggregating\n", e->name);
+	}
 }
 
 /*===========================================================================*
@@ -275,6 +759,13 @@ static int sge_probe(sge_t *e, int skip)
 	/* Reserve PCI resources found. */
 	if ((r = pci_reserve_ok(devind)) != OK)
 	{
+		/* The next port already runs as an instance of its own. */
+		if (e->lag_peer)
+		{
+			printf("%s: port in use by another instance: %d\n",
+				e->name, r);
+			return FALSE;
+		}
 		panic("failed to reserve PCI device: %d", r);
 	}
 	/* Read PCI configuration. */
@@ -293,6 +784,9 @@ static int sge_probe(sge_t *e, int skip)
 	if (!(cr & PCI_CR_MAST_EN))
 		pci_attr_w16(devind, PCI_CR, cr | PCI_CR_MAST_EN);
 
+	e->devind = devind;
+	sge_pci_tune(e);
+
 	/* Where to read MAC from? */
 	int isAPC = pci_attr_r8(devind, 0x73);
 	if ((isAPC & 0x1) == 0)
@@ -307,13 +801,52 @@ static int sge_probe(sge_t *e, int skip)
 	return TRUE;
 }
 
+/*===========================================================================*
+ *                             sge_pci_tune                                  *
+ *===========================================================================*/
+static void sge_pci_tune(e)
+sge_t *e;
+{
+	const sge_tune_t *t;
+	u16_t cr;
+
+	/* Anything not configured comes from the table. */
+	for (t = sge_tune; t->model != 0 && t->model != e->model; t++)
+		;
+	if (e->pci_cls < 0)
+		e->pci_cls = t->cls;
+	if (e->pci_latency < 0)
+		e->pci_latency = t->latency;
+	if (e->pci_mwi < 0)
+		e->pci_mwi = t->mwi;
+	if (e->dma_tx_ctl < 0)
+		e->dma_tx_ctl = t->tx_ctl;
+	if (e->dma_rx_ctl < 0)
+		e->dma_rx_ctl = t->rx_ctl;
+	e->dma_tx_ctl &= SGE_DMA_CTL_MASK;
+	e->dma_rx_ctl &= SGE_DMA_CTL_MASK;
+
+	if (e->pci_cls)
+		pci_attr_w8(e->devind, SGE_PCI_CLS, e->pci_cls / 4);
+	if (e->pci_latency)
+		pci_attr_w8(e->devind, SGE_PCI_LAT, e->pci_latency);
+
+	/* MWI needs a cache line size the bridge accepted. */
+	cr = pci_attr_r16(e->devind, PCI_CR);
+	if (e->pci_mwi && pci_attr_r8(e->devind, SGE_PCI_CLS) != 0)
+		cr |= SGE_PCI_CR_MWI;
+	else
+		cr &= ~SGE_PCI_CR_MWI;
+	pci_attr_w16(e->devind, PCI_CR, cr);
+}
+
 /*===========================================================================*
  *                              sge_init_hw                                  *
  *===========================================================================*/
 static int sge_init_hw(e)
 sge_t *e;
 {
-	int r, i;
+	int r, i, fast;
 	uint32_t control;
 	uint16_t filter;
 
@@ -337,14 +870,22 @@ sge_t *e;
 	/* Reset hardware. */
 	sge_reset_hw(e);
 
-	/* Initialization routine */
-	sge_init_addr(e);
+	/* Initialization routine, shortened after a crash. */
+	fast = e->restarted && sge_ckpt_restore(e);
+	if (!fast)
+		sge_init_addr(e);
+	if (e->lag_peer)
+		e->address = sge_state.address;
 	sge_init_buf(e);
 
-	if (sge_mii_probe(e) == 0)
+	if (!fast && sge_mii_probe(e) == 0)
 	{
 		return -ENODEV;
 	}
+	if (e->autoneg_done && !e->lag_peer)
+		sge_ckpt_save(e);
+	if (e->lag_hash)
+		sge_lag_link(e);
 
 	sge_reg_write(e, SGE_REG_RXMACADDR, 0);
 
@@ -363,6 +904,12 @@ sge_t *e;
 		sge_reg_write(e, SGE_REG_RXMACADDR + i, w);
 	}
 
+	/* Let the card strip tags when a native VLAN is configured. */
+	if (e->vlan_pvid)
+		filter |= SGE_RXCTRL_STRIP_VLAN;
+	else
+		filter &= ~SGE_RXCTRL_STRIP_VLAN;
+
 	/* Enable filter */
 	filter |= SGE_RXCTRL_MYPHYS;
 	if (e->flags & SGE_PROMISC)
@@ -383,7 +930,10 @@ sge_t *e;
 	sge_reg_write(e, SGE_REG_RXHASHTABLE2, 0xffffffff);
 
 	/* Enable interrupts */
-	sge_reg_write(e, SGE_REG_INTRMASK, SGE_INTRS);
+#if SGE_INTR_COAL
+	sge_reg_write(e, SGE_REG_INTRTIMER, SGE_INTR_COAL);
+#endif
+	sge_reg_write(e, SGE_REG_INTRMASK, SGE_INTR_MASK(e));
 
 	/* Enable TX/RX */
 	control = sge_reg_read(e, SGE_REG_TX_CTL);
@@ -391,9 +941,34 @@ sge_t *e;
 	control = sge_reg_read(e, SGE_REG_RX_CTL);
 	sge_reg_write(e, SGE_REG_RX_CTL, control | 0x1 | 0x10);
 
+#if SGE_SELFTEST
+	if (e->selftest_nr && e->mii != NULL)
+		sge_selftest(e);
+#endif
+
+	if (!e->lag_peer)
+		sge_init_services(e);
+
 	return TRUE;
 }
 
+/*===========================================================================*
+ *                           sge_init_services                               *
+ *===========================================================================*/
+static void sge_init_services(e)
+sge_t *e;
+{
+	/* Start the rate sampler and the housekeeping poll. */
+	getuptime(&e->sample_last);
+	e->poll_last = e->sample_last;
+	sge_alarm(e);
+	sge_statpage_init(e);
+#if SGE_CAPTURE
+	sge_capture_init(e);
+#endif
+	sge_caps_publish(e);
+}
+
 /*===========================================================================*
  *                             sge_init_addr                                 *
  *===========================================================================*/
@@ -450,6 +1025,67 @@ sge_t *e;
 	}
 }
 
+/*===========================================================================*
+ *                             sge_init_vlan                                 *
+ *===========================================================================*/
+static void sge_init_vlan(e)
+sge_t *e;
+{
+	static char vlanfmt[] = "d:d:d:d:d:d:d:d:d:d:d:d:d:d:d:d";
+	long v;
+	int i;
+
+	/*
+	 * 'vlan' is the native VLAN: tagged by the card on transmit and
+	 * stripped on receive. 'vlans' lists the other VLANs to accept.
+	 * Once either is set, frames on any other VLAN are dropped before
+	 * they are copied.
+	 */
+	memset(e->vlan_map, 0, sizeof(e->vlan_map));
+	e->vlan_pvid = sge_env("vlan", 0, 0, 4094);
+	if (e->vlan_pvid)
+	{
+		e->vlan_map[e->vlan_pvid / 32] |= 1U << (e->vlan_pvid % 32);
+		e->vlan_filter = TRUE;
+		e->caps |= SGE_CAP_VLAN;
+	}
+
+	for (i = 0; i < SGE_VLAN_NR; i++)
+	{
+		if (env_parse("vlans", vlanfmt, i, &v, 1, 4094) != EP_SET)
+			break;
+		e->vlan_map[v / 32] |= 1U << (v % 32);
+		e->vlan_filter = TRUE;
+	}
+}
+
+/*===========================================================================*
+ *                             sge_init_prio                                 *
+ *===========================================================================*/
+static void sge_init_prio(e)
+sge_t *e;
+{
+	long v;
+
+	/*
+	 * Priority lane classifiers: prio_type=<hex EtherType>,
+	 * prio_dscp=<lowest DSCP> and prio_size=<largest frame>. Without
+	 * any, all frames share one lane as before.
+	 */
+	v = 0;
+	(void)env_parse("prio_type", "x", 0, &v, 0, 0xffff);
+	e->prio_type = v;
+	e->prio_dscp = sge_env("prio_dscp", 0, 0, 63);
+	e->prio_size = sge_env("prio_size", 0, 0, ETH_MAX_PACK_SIZE);
+
+	e->prio_on = (e->prio_type || e->prio_dscp || e->prio_size);
+	if (e->prio_on)
+	{
+		e->prio_reserve = sge_env("prio_reserve", SGE_PRIO_RESERVE, 1,
+			e->tx_desc_nr - 1);
+	}
+}
+
 /*===========================================================================*
  *                              sge_init_buf                                 *
  *===========================================================================*/
@@ -457,101 +1093,154 @@ static void sge_init_buf(e)
 sge_t *e;
 {
 	/* This function initializes the TX/RX rings, used for DMA transfers */
-	int i, rx_align, tx_align;
-	phys_bytes rx_buff_p;
-	phys_bytes tx_buff_p;
-	phys_bytes rx_desc_p;
-	phys_bytes tx_desc_p;
-
-	if (!e->rx_desc)
-	{
-		/* Allocate RX descriptors.    */
-		/* rx_desc: Virtual address    */
-		/* rx_desc_p: Physical address */
-		if ((e->rx_desc = alloc_contig(SGE_RXD_TOTALSIZE + 15, AC_ALIGN4K,
-			&rx_desc_p)) == NULL)
-		{
-			panic("%s: Failed to allocate RX descriptors.\n", e->name);
-		}
-		memset(e->rx_desc, 0, SGE_RXD_TOTALSIZE + 15);
+	size_t rx_desc_off, tx_desc_off, rx_buff_off, tx_buff_off, size;
 
-		/* Allocate RX buffers */
-		if ((e->rx_buffer = alloc_contig(SGE_RXB_TOTALSIZE + 15, AC_ALIGN4K,
-			&rx_buff_p)) == NULL)
+	/*
+	 * Lay the rings and buffer pools out in one physically contiguous
+	 * arena, each part starting on a cache line. Descriptors come first,
+	 * so both rings share the first pages.
+	 */
+	rx_desc_off = 0;
+	tx_desc_off = SGE_ALIGN(rx_desc_off +
+		e->rx_desc_nr * sizeof(sge_desc_t), SGE_CACHELINE);
+	rx_buff_off = SGE_ALIGN(tx_desc_off +
+		e->tx_desc_nr * sizeof(sge_desc_t), SGE_CACHELINE);
+	tx_buff_off = rx_buff_off + e->rx_desc_nr * SGE_BUF_SIZE;
+	size = tx_buff_off + e->tx_desc_nr * SGE_BUF_SIZE;
+
+	/* Reuse the arena on re-initialization, if the geometry still fits. */
+	if (e->arena && e->arena_size < size)
+	{
+		free_contig(e->arena, e->arena_size);
+		e->arena = NULL;
+	}
+	if (!e->arena)
+	{
+		if ((e->arena = alloc_contig(size, AC_ALIGN4K, &e->arena_p)) == NULL)
 		{
-			panic("%s: Failed to allocate RX buffers.\n", e->name);
+			panic("%s: Failed to allocate DMA arena.\n", e->name);
 		}
-		memset(e->rx_buffer, 0, SGE_RXB_TOTALSIZE + 15);
+		e->arena_size = size;
+	}
+	memset(e->arena, 0, size);
 
-		/* Align addresses to multiple of 16 bit */
-		rx_align = ((rx_buff_p + 0xf) & ~0xf) - rx_buff_p;
-		rx_buff_p = ((rx_buff_p + 0xf) & ~0xf);
+	e->rx_desc = (sge_desc_t *)(e->arena + rx_desc_off);
+	e->rx_desc_p = e->arena_p + rx_desc_off;
+	e->tx_desc = (sge_desc_t *)(e->arena + tx_desc_off);
+	e->tx_desc_p = e->arena_p + tx_desc_off;
+	e->rx_buffer = e->arena + rx_buff_off;
+	e->rx_buffer_p = e->arena_p + rx_buff_off;
+	e->tx_buffer = e->arena + tx_buff_off;
+	e->tx_buffer_p = e->arena_p + tx_buff_off;
 
-		e->cur_rx = 0;
+	sge_init_rx_ring(e);
+	sge_init_tx_ring(e);
 
-		/* Setup receive descriptors. */
-		for (i = 0; i < SGE_RXDESC_NR; i++)
+	if (!e->txq_buf && e->txq_depth)
+	{
+		/* Software TX backlog, drained as descriptors complete. */
+		if ((e->txq_buf = malloc(e->txq_depth * SGE_BUF_SIZE)) == NULL ||
+			(e->txq_len = malloc(e->txq_depth * sizeof(uint16_t))) == NULL)
 		{
-			/* RX descriptors are initially held by hardware */
-			e->rx_desc[i].pkt_size = 0;
-			e->rx_desc[i].status = SGE_RXSTATUS_RXOWN | SGE_RXSTATUS_RXINT;
-			e->rx_desc[i].buf_ptr = rx_buff_p + (i * SGE_BUF_SIZE);
-			e->rx_desc[i].flags = (SGE_BUF_SIZE & 0xfff8);
+			panic("%s: Failed to allocate TX backlog.\n", e->name);
 		}
-		/* Last descriptor is marked as final */
-		e->rx_desc[SGE_RXDESC_NR - 1].flags |= SGE_DESC_FINAL;
+		e->txq_head = e->txq_tail = 0;
+	}
+
+	if (!e->rx_stamps && e->dwell_on)
+	{
+		/* First sight of the frame in each RX descriptor. */
+		if ((e->rx_stamps = malloc(e->rx_desc_nr * sizeof(uint64_t))) == NULL)
+			panic("%s: Failed to allocate RX stamps.\n", e->name);
+	}
+
+	if (!e->tx_stage && (e->peer || e->prio_on))
+	{
+		/* Frames are classified and hashed here, before they move. */
+		if ((e->tx_stage = malloc(SGE_BUF_SIZE)) == NULL)
+			panic("%s: Failed to allocate TX staging.\n", e->name);
 	}
 
-	if (!e->tx_desc)
+	if (!e->tx_prio && e->prio_on)
 	{
-		/* Allocate TX descriptors.    */
-		/* tx_desc: Virtual address    */
-		/* tx_desc_p: Physical address */
-		if ((e->tx_desc = alloc_contig(SGE_TXD_TOTALSIZE + 15, AC_ALIGN4K,
-			&tx_desc_p)) == NULL)
+		/* Priority lane: class of each descriptor, and its own backlog. */
+		if ((e->tx_prio = malloc(e->tx_desc_nr)) == NULL ||
+			(e->prioq_buf = malloc(SGE_PRIOQ_NR * SGE_BUF_SIZE)) == NULL)
 		{
-			panic("%s: Failed to allocate TX descriptors.\n", e->name);
+			panic("%s: Failed to allocate priority lane.\n", e->name);
 		}
-		memset(e->tx_desc, 0, SGE_TXD_TOTALSIZE + 15);
+		e->prioq_head = e->prioq_tail = 0;
+	}
+	if (e->tx_prio)
+		memset(e->tx_prio, 0, e->tx_desc_nr);
 
-		/* Allocate TX buffers */
-		if ((e->tx_buffer = alloc_contig(SGE_TXB_TOTALSIZE + 15, AC_ALIGN4K,
-			&tx_buff_p)) == NULL)
+	if (!e->rxq_buf && e->rxq_depth)
+	{
+		/* Software RX queue, filled while no read is pending. */
+		if ((e->rxq_buf = malloc(e->rxq_depth * SGE_BUF_SIZE)) == NULL ||
+			(e->rxq_len = malloc(e->rxq_depth * sizeof(uint16_t))) == NULL ||
+			(e->rxq_status = malloc(e->rxq_depth * sizeof(uint32_t))) == NULL ||
+			(e->rxq_stamp = malloc(e->rxq_depth * sizeof(uint64_t))) == NULL)
 		{
-			panic("%s: Failed to allocate TX buffers.\n", e->name);
+			panic("%s: Failed to allocate RX queue.\n", e->name);
 		}
-		memset(e->tx_buffer, 0, SGE_TXB_TOTALSIZE + 15);
+		e->rxq_head = e->rxq_tail = 0;
+	}
+}
 
-		/* Align addresses to multiple of 16 bit */
-		tx_align = ((tx_buff_p + 0xf) & ~0xf) - tx_buff_p;
-		tx_buff_p = ((tx_buff_p + 0xf) & ~0xf);
+/*===========================================================================*
+ *                            sge_init_rx_ring                               *
+ *===========================================================================*/
+static void sge_init_rx_ring(e)
+sge_t *e;
+{
+	uint32_t i;
 
-		e->cur_tx = 0;
+	e->cur_rx = 0;
+	e->rx_stamped = 0;
 
-		/* Setup receive descriptors. */
-		for (i = 0; i < SGE_TXDESC_NR; i++)
-		{
-			/* TX descriptors will be filled by software */
-			e->tx_desc[i].pkt_size = 0;
-			e->tx_desc[i].status = 0;
-			e->tx_desc[i].buf_ptr = 0;
-			e->tx_desc[i].flags = 0;
-		}
-		/* Last descriptor is marked as final */
-		e->tx_desc[SGE_TXDESC_NR - 1].flags = SGE_DESC_FINAL;
+	/* Setup receive descriptors. */
+	for (i = 0; i < e->rx_desc_nr; i++)
+	{
+		/* RX descriptors are initially held by hardware */
+		e->rx_desc[i].pkt_size = 0;
+		e->rx_desc[i].status = SGE_RXSTATUS_RXOWN | SGE_RXSTATUS_RXINT;
+		e->rx_desc[i].buf_ptr = e->rx_buffer_p + (i * SGE_BUF_SIZE);
+		e->rx_desc[i].flags = (SGE_BUF_SIZE & 0xfff8);
 	}
+	/* Last descriptor is marked as final */
+	e->rx_desc[e->rx_desc_nr - 1].flags |= SGE_DESC_FINAL;
+
+	/* Inform card where the ring is */
+	sge_reg_write(e, SGE_REG_RX_DESC, e->rx_desc_p);
+}
+
+/*===========================================================================*
+ *                            sge_init_tx_ring                               *
+ *===========================================================================*/
+static void sge_init_tx_ring(e)
+sge_t *e;
+{
+	uint32_t i;
+
+	e->cur_tx = 0;
+	e->dirty_tx = 0;
+	e->tx_inuse = 0;
 
-	/* Apply alignment to virtual addresses, and store at status */
-	e->tx_buffer += tx_align;
-	e->rx_buffer += rx_align;
-	e->tx_buffer_p = tx_buff_p;
-	e->rx_buffer_p = rx_buff_p;
-	e->tx_desc_p = tx_desc_p;
-	e->rx_desc_p = rx_desc_p;
+	/* Setup transmit descriptors. */
+	for (i = 0; i < e->tx_desc_nr; i++)
+	{
+		/* TX descriptors will be filled by software */
+		e->tx_desc[i].pkt_size = 0;
+		e->tx_desc[i].status = 0;
+		e->tx_desc[i].buf_ptr = 0;
+		e->tx_desc[i].flags = 0;
+	}
+	/* Last descriptor is marked as final */
+	e->tx_desc[e->tx_desc_nr - 1].flags = SGE_DESC_FINAL;
 
-	/* Inform card where the buffer is */
-	sge_reg_write(e, SGE_REG_TX_DESC, tx_desc_p);
-	sge_reg_write(e, SGE_REG_RX_DESC, rx_desc_p);
+	/* Inform card where the ring is */
+	sge_reg_write(e, SGE_REG_TX_DESC, e->tx_desc_p);
 }
 
 /*===========================================================================*
@@ -563,8 +1252,9 @@ sge_t *e;
 	sge_reg_write(e, SGE_REG_INTRMASK, 0);
 	sge_reg_write(e, SGE_REG_INTRSTATUS, 0xffffffff);
 
-	sge_reg_write(e, SGE_REG_TX_CTL, 0x00001c00);
-	sge_reg_write(e, SGE_REG_RX_CTL, 0x001e1c00);
+	/* DMA burst and FIFO thresholds, as tuned at probe. */
+	sge_reg_write(e, SGE_REG_TX_CTL, e->dma_tx_ctl);
+	sge_reg_write(e, SGE_REG_RX_CTL, e->dma_rx_ctl);
 
 	sge_reg_write(e, SGE_REG_INTRCONTROL, 0x8000);
 	sge_reg_read(e, SGE_REG_INTRCONTROL);
@@ -599,7 +1289,8 @@ sge_t *e;
 
 	sge_reg_write(e, SGE_REG_RGMIIDELAY, 0x0);
 	sge_reg_write(e, SGE_REG_RESERVED3, 0x0);
-	sge_reg_write(e, SGE_REG_RXMACCONTROL, 0x12);
+	sge_reg_write(e, SGE_REG_RXMACCONTROL,
+		SGE_RXCTRL_STRIP_FCS | SGE_RXCTRL_CSUM);
 
 	sge_reg_write(e, SGE_REG_RXHASHTABLE, 0x0);
 	sge_reg_write(e, SGE_REG_RXHASHTABLE2, 0x0);
@@ -618,245 +1309,2195 @@ message *mp;
 int from_int;
 {
 	sge_t *e = &sge_state;
-	sge_desc_t *desc;
-	iovec_s_t iovec[SGE_IOVEC_NR];
-	int r, i, bytes = 0, size;
-	uint32_t command;
-	uint32_t current;
-	uint32_t status;
 
 	/* Are we called from the interrupt handler? */
 	if (!from_int)
 	{
-		if (!(e->autoneg_done))
-		{
-			return;
-		}
-
 		/* Copy write message. */
 		e->tx_message = *mp;
 		e->client = mp->m_source;
 		e->status |= SGE_WRITING;
+		e->tx_iovec_valid = FALSE;
+		e->tx_staged = 0;
+	}
 
-		/*
-		 * Copy the I/O vector table.
-		 */
-		if ((r = sys_safecopyfrom(e->tx_message.m_source,
-			e->tx_message.m_net_netdrv_dl_writev_s.grant, 0,
-			(vir_bytes) iovec,
-			e->tx_message.m_net_netdrv_dl_writev_s.count *
-			sizeof(iovec_s_t))) != OK)
-		{
-			panic("sys_safecopyfrom() failed: %d", r);
-		}
-
-		current = e->cur_tx % SGE_TXDESC_NR;
-		desc = &e->tx_desc[current];
-
-		/* Loop vector elements. */
-		for (i = 0; i < e->tx_message.m_net_netdrv_dl_writev_s.count; i++)
-		{
-			size = iovec[i].iov_size < (SGE_BUF_SIZE - bytes) ?
-				iovec[i].iov_size : (SGE_BUF_SIZE - bytes);
-
-			/* Copy bytes to TX queue buffers. */
-			if ((r = sys_safecopyfrom(e->tx_message.m_source,
-				iovec[i].iov_grant, 0,
-				(vir_bytes) e->tx_buffer + bytes +
-				(current * SGE_BUF_SIZE), size)) != OK)
-			{
-				panic("sys_safecopyfrom() failed: %d", r);
-			}
-
-			bytes += size;
-		}
-
-		/* Mark this descriptor ready. */
-		desc->pkt_size = size & 0xffff;
-		desc->status = (SGE_TXSTATUS_PADEN | SGE_TXSTATUS_CRCEN |
-			SGE_TXSTATUS_DEFEN | SGE_TXSTATUS_THOL3 | SGE_TXSTATUS_TXINT);
-		desc->buf_ptr = e->tx_buffer_p + (current * SGE_BUF_SIZE);
-		desc->flags |= size & 0xffff;
-		if (e->duplex_mode == 0)
-		{
-			desc->status |= (SGE_TXSTATUS_COLSEN | SGE_TXSTATUS_CRSEN |
-				SGE_TXSTATUS_BKFEN);
-			if (e->link_speed == SGE_SPEED_1000)
-				desc->status |= (SGE_TXSTATUS_EXTEN | SGE_TXSTATUS_BSTEN);
-		}
-		desc->status |= SGE_TXSTATUS_TXOWN;
+	/* Take back finished descriptors, and refill them from the backlog. */
+	sge_tx_reclaim(e);
+	if (e->peer)
+		sge_tx_reclaim(e->peer);
+	sge_tx_flush(e);
 
-		/* Increment tail. Start transmission. */
-		e->cur_tx = (current + 1) % SGE_TXDESC_NR;
-		command = sge_reg_read(e, SGE_REG_TX_CTL);
-		sge_reg_write(e, SGE_REG_TX_CTL, 0x10 | command);
-	}
-	else
+	/* Accept the pending frame, unless the backlog is full. */
+	if ((e->status & SGE_WRITING) && !(e->status & SGE_TRANSMIT))
 	{
-		e->status |= SGE_TRANSMIT;
+		if (sge_tx_admit(e))
+			e->status |= SGE_TRANSMIT;
+		else if (from_int)
+			return;
+		else
+			e->stats.tx_held++;
+	}
+	else if (from_int)
+	{
+		return;
 	}
 	reply(e);
 }
 
 /*===========================================================================*
- *                              sge_readv_s                                  *
+ *                              sge_tx_admit                                 *
  *===========================================================================*/
-static void sge_readv_s(mp, from_int)
-message *mp;
-int from_int;
+static int sge_tx_admit(e)
+sge_t *e;
+{
+	sge_t *p;
+	char *buf;
+	size_t len;
+	int prio;
+
+	/*
+	 * Copy the I/O vector table, once per request. A request held back
+	 * by a full backlog reuses it when retried.
+	 */
+	if (!e->tx_iovec_valid)
+	{
+		sge_iovec_fetch(e, &e->tx_message,
+			e->tx_message.m_net_netdrv_dl_writev_s.grant,
+			e->tx_message.m_net_netdrv_dl_writev_s.count, e->tx_iovec);
+		e->stats.tx_copy_bytes +=
+			e->tx_message.m_net_netdrv_dl_writev_s.count *
+			sizeof(iovec_s_t);
+		e->tx_iovec_valid = TRUE;
+	}
+
+	/*
+	 * With a priority lane the frame is classified before it goes
+	 * anywhere: priority frames may pass queued bulk ones, and bulk keeps
+	 * off the reserved descriptors. Aggregated, it is hashed to one of
+	 * the two rings. Both look at the frame in the staging buffer, where
+	 * it stays across retries, so it is copied from the client once.
+	 */
+	if (e->prio_on || e->peer)
+	{
+		if (!e->tx_staged)
+			e->tx_staged = sge_tx_copy(e, e->tx_stage);
+		buf = e->tx_stage;
+		len = e->tx_staged;
+		prio = e->prio_on && sge_tx_classify(e, (uint8_t *) buf, len);
+		p = sge_lag_pick(e, (uint8_t *) buf, len);
+
+		if (p->autoneg_done && !SGE_PG_ACTIVE(e) && !sge_tx_paused(e) &&
+			p->tx_inuse < p->tx_desc_nr && (prio ?
+			e->prioq_tail == e->prioq_head :
+			(e->txq_tail == e->txq_head && e->prioq_tail == e->prioq_head &&
+			p->tx_inuse < p->tx_desc_nr - p->prio_reserve)))
+		{
+			memcpy(p->tx_buffer +
+				((p->cur_tx % p->tx_desc_nr) * SGE_BUF_SIZE), buf, len);
+			sge_tx_post(p, len,
+				prio ? SGE_TXO_PRIO : SGE_TXO_CLIENT);
+			sge_reg_set(p, SGE_REG_TX_CTL, 0x10);
+		}
+		else if (!sge_tx_enqueue(e, buf, len, prio))
+		{
+			return FALSE;
+		}
+		e->tx_staged = 0;
+		return TRUE;
+	}
+
+	/* Straight to the ring, if nothing is queued ahead of us. */
+	if (e->autoneg_done && !SGE_PG_ACTIVE(e) && !sge_tx_paused(e) &&
+		e->tx_inuse < e->tx_desc_nr && e->txq_tail == e->txq_head)
+	{
+		len = sge_tx_copy(e,
+			e->tx_buffer + ((e->cur_tx % e->tx_desc_nr) * SGE_BUF_SIZE));
+		sge_tx_post(e, len, SGE_TXO_CLIENT);
+		sge_reg_set(e, SGE_REG_TX_CTL, 0x10);
+		return TRUE;
+	}
+
+	/* Otherwise into the backlog, while there is room. */
+	if (e->txq_tail - e->txq_head < e->txq_depth)
+	{
+		buf = e->txq_buf + ((e->txq_tail % e->txq_depth) * SGE_BUF_SIZE);
+		len = sge_tx_copy(e, buf);
+		return sge_tx_enqueue(e, buf, len, FALSE);
+	}
+
+	return FALSE;
+}
+
+/*===========================================================================*
+ *                             sge_tx_enqueue                                *
+ *===========================================================================*/
+static int sge_tx_enqueue(e, buf, len, prio)
+sge_t *e;
+char *buf;
+size_t len;
+int prio;
+{
+	uint32_t slot;
+	char *dst;
+
+	/* Priority frames wait apart, and leave first. */
+	if (prio && e->prioq_tail - e->prioq_head < SGE_PRIOQ_NR)
+	{
+		slot = e->prioq_tail % SGE_PRIOQ_NR;
+		memcpy(e->prioq_buf + (slot * SGE_BUF_SIZE), buf, len);
+		e->prioq_len[slot] = len;
+		e->prioq_tail++;
+		e->stats.tx_prio_backlogged++;
+		return TRUE;
+	}
+
+	/* The frame may already sit in the next backlog slot. */
+	if (e->txq_tail - e->txq_head < e->txq_depth)
+	{
+		slot = e->txq_tail % e->txq_depth;
+		dst = e->txq_buf + (slot * SGE_BUF_SIZE);
+		if (dst != buf)
+			memcpy(dst, buf, len);
+		e->txq_len[slot] = len;
+		e->txq_tail++;
+		if (e->txq_tail - e->txq_head > e->txq_max)
+			e->txq_max = e->txq_tail - e->txq_head;
+		e->stats.tx_backlogged++;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*===========================================================================*
+ *                            sge_tx_classify                                *
+ *===========================================================================*/
+static int sge_tx_classify(e, buf, len)
+sge_t *e;
+uint8_t *buf;
+size_t len;
+{
+	uint32_t type, off;
+
+	if (e->prio_size && len <= e->prio_size)
+		return TRUE;
+	if (len < ETH_HDR_SIZE)
+		return FALSE;
+
+	/* Look past one VLAN tag. */
+	type = (buf[12] << 8) | buf[13];
+	off = ETH_HDR_SIZE;
+	if (type == SGE_ETHERTYPE_VLAN && len >= ETH_HDR_SIZE + 4)
+	{
+		type = (buf[16] << 8) | buf[17];
+		off += 4;
+	}
+
+	if (e->prio_type && type == e->prio_type)
+		return TRUE;
+	if (e->prio_dscp && type == SGE_ETHERTYPE_IP && len > off + 1 &&
+		(buf[off + 1] >> 2) >= e->prio_dscp)
+	{
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*===========================================================================*
+ *                              sge_tx_copy                                  *
+ *===========================================================================*/
+static size_t sge_tx_copy(e, buf)
+sge_t *e;
+char *buf;
+{
+	iovec_s_t *iovec = e->tx_iovec;
+	int r, i;
+	size_t bytes = 0, size;
+
+	/* Loop vector elements. */
+	for (i = 0; i < e->tx_message.m_net_netdrv_dl_writev_s.count; i++)
+	{
+		size = iovec[i].iov_size < (SGE_BUF_SIZE - bytes) ?
+			iovec[i].iov_size : (SGE_BUF_SIZE - bytes);
+
+		/* Copy bytes to TX queue buffers. */
+		if ((r = sys_safecopyfrom(e->tx_message.m_source,
+			iovec[i].iov_grant, 0, (vir_bytes) buf + bytes, size)) != OK)
+		{
+			panic("sys_safecopyfrom() failed: %d", r);
+		}
+
+		bytes += size;
+	}
+
+#if SGE_CAPTURE
+	if (e->cap_ring)
+		sge_capture(e, buf, bytes);
+#endif
+
+	e->stats.tx_copy_bytes += bytes;
+
+	return bytes;
+}
+
+/*===========================================================================*
+ *                              sge_tx_post                                  *
+ *===========================================================================*/
+static void sge_tx_post(e, len, origin)
+sge_t *e;
+size_t len;
+int origin;
 {
-	sge_t *e = &sge_state;
 	sge_desc_t *desc;
-	iovec_s_t iovec[SGE_IOVEC_NR];
-	int r, i, bytes = 0, size;
-	uint32_t command;
+	uint8_t *buf;
 	uint32_t current;
-	uint32_t status;
-	uint32_t pkt_size;
 
-	/* Are we called from the interrupt handler? */
-	if (!from_int)
+	/* The frame is already in the buffer of the current descriptor. */
+	current = e->cur_tx % e->tx_desc_nr;
+	desc = &e->tx_desc[current];
+	buf = (uint8_t *) e->tx_buffer + (current * SGE_BUF_SIZE);
+
+	/* Mark this descriptor ready. */
+	desc->pkt_size = len & 0xffff;
+	desc->status = (SGE_TXSTATUS_PADEN | SGE_TXSTATUS_CRCEN |
+		SGE_TXSTATUS_DEFEN | SGE_TXSTATUS_THOL3 | SGE_TXSTATUS_TXINT);
+	desc->buf_ptr = e->tx_buffer_p + (current * SGE_BUF_SIZE);
+	desc->flags = (desc->flags & SGE_DESC_FINAL) | (len & 0xffff);
+	if (e->duplex_mode == 0)
+	{
+		desc->status |= (SGE_TXSTATUS_COLSEN | SGE_TXSTATUS_CRSEN |
+			SGE_TXSTATUS_BKFEN);
+		if (e->link_speed == SGE_SPEED_1000)
+			desc->status |= (SGE_TXSTATUS_EXTEN | SGE_TXSTATUS_BSTEN);
+	}
+	if ((e->caps & SGE_CAP_TXCSUM) && origin != SGE_TXO_CTRL)
+		desc->status |= sge_tx_csum(buf, len);
+	if (e->vlan_pvid && len >= ETH_HDR_SIZE && origin != SGE_TXO_CTRL &&
+		((buf[12] << 8) | buf[13]) != SGE_ETHERTYPE_VLAN)
+	{
+		/* Untagged frames leave on the native VLAN; MAC control never. */
+		desc->pkt_size |= SGE_TXINFO_INSVLAN;
+		desc->status |= e->vlan_pvid;
+	}
+	desc->status |= SGE_TXSTATUS_TXOWN;
+
+	/* Generated and control frames have counters of their own. */
+	if (origin == SGE_TXO_CLIENT || origin == SGE_TXO_PRIO)
+	{
+		e->stats.tx_packets++;
+		e->stats.tx_bytes += len;
+	}
+	if (e->tx_prio)
+	{
+		e->tx_prio[current] = (origin == SGE_TXO_PRIO);
+		if (origin == SGE_TXO_PRIO)
+			e->stats.tx_prio_packets++;
+	}
+
+	/* Increment tail. The caller starts transmission. */
+	e->cur_tx = (current + 1) % e->tx_desc_nr;
+	e->tx_inuse++;
+}
+
+/*===========================================================================*
+ *                             sge_tx_recover                                *
+ *===========================================================================*/
+static void sge_tx_recover(e)
+sge_t *e;
+{
+	/*
+	 * Restart a halted or stuck transmitter without touching the MAC or
+	 * PHY: stop the engine, rebuild the ring, point the card at it again
+	 * and resubmit the backlog.
+	 */
+	sge_reg_unset(e, SGE_REG_TX_CTL, 0x1);
+
+	sge_tx_reclaim(e);
+	e->stats.tx_lost += e->tx_inuse;
+	sge_init_tx_ring(e);
+
+	sge_reg_set(e, SGE_REG_TX_CTL, 0x1);
+	sge_tx_flush(e);
+
+	e->tx_wd_done = e->stats.tx_done;
+	e->tx_wd_polls = 0;
+}
+
+/*===========================================================================*
+ *                             sge_tx_watchdog                               *
+ *===========================================================================*/
+static void sge_tx_watchdog(e)
+sge_t *e;
+{
+	/* Catch descriptors left in TXOWN without a completion. */
+	sge_tx_reclaim(e);
+	if (e->tx_inuse == 0 || e->stats.tx_done != e->tx_wd_done)
+	{
+		e->tx_wd_done = e->stats.tx_done;
+		e->tx_wd_polls = 0;
+		return;
+	}
+	if (++e->tx_wd_polls < SGE_TX_TIMEOUT)
+		return;
+
+	printf("%s: TX timeout, %u descriptors stuck\n", e->name, e->tx_inuse);
+	e->stats.tx_timeouts++;
+	sge_tx_recover(e);
+	sge_writev_s(&e->tx_message, TRUE);
+}
+
+/*===========================================================================*
+ *                              sge_tx_csum                                  *
+ *===========================================================================*/
+static uint32_t sge_tx_csum(frame, len)
+uint8_t *frame;
+size_t len;
+{
+	uint8_t *ip, *sum;
+	uint32_t acc, cmd;
+	size_t hlen, plen;
+	int i;
+
+	/*
+	 * Select checksum insertion for unfragmented IPv4 TCP and UDP. The
+	 * card expects the IP checksum cleared and the TCP/UDP checksum
+	 * seeded with the pseudo-header sum.
+	 */
+	ip = frame + ETH_HDR_SIZE;
+	if (((frame[12] << 8) | frame[13]) == SGE_ETHERTYPE_VLAN)
+		ip += 4;
+	if (ip + 20 > frame + len ||
+		((ip[-2] << 8) | ip[-1]) != SGE_ETHERTYPE_IP ||
+		(ip[0] >> 4) != 4 || ((ip[6] & 0x3f) | ip[7]) != 0)
+	{
+		return 0;
+	}
+	hlen = (ip[0] & 0x0f) * 4;
+	plen = ((ip[2] << 8) | ip[3]);
+	if (hlen < 20 || plen < hlen || ip + plen > frame + len)
+		return 0;
+
+	switch (ip[9])
+	{
+	case SGE_IPPROTO_TCP:
+		if (plen < hlen + 20)
+			return 0;
+		sum = ip + hlen + 16;
+		cmd = SGE_TXSTATUS_IPCS | SGE_TXSTATUS_TCPCS;
+		break;
+	case SGE_IPPROTO_UDP:
+		/* A zero UDP checksum means none; leave it that way. */
+		if (plen < hlen + 8 || (ip[hlen + 6] | ip[hlen + 7]) == 0)
+			return 0;
+		sum = ip + hlen + 6;
+		cmd = SGE_TXSTATUS_IPCS | SGE_TXSTATUS_UDPCS;
+		break;
+	default:
+		return 0;
+	}
+
+	/* Pseudo header: addresses, protocol and payload length. */
+	acc = ip[9] + (plen - hlen);
+	for (i = 12; i < 20; i += 2)
+		acc += (ip[i] << 8) | ip[i + 1];
+	while (acc >> 16)
+		acc = (acc & 0xffff) + (acc >> 16);
+
+	ip[10] = ip[11] = 0;
+	sum[0] = acc >> 8;
+	sum[1] = acc & 0xff;
+
+	return cmd;
+}
+
+/*===========================================================================*
+ *                            sge_caps_publish                               *
+ *===========================================================================*/
+static void sge_caps_publish(e)
+sge_t *e;
+{
+	char key[DS_MAX_KEYLEN];
+	int r;
+
+	/* Tell the stack which checksums it may leave to the card. */
+	snprintf(key, sizeof(key), SGE_CAPS_KEY, sge_instance);
+	if ((r = ds_publish_u32(key, e->caps, DSF_OVERWRITE)) != OK)
+		printf("%s: failed to publish %s: %d\n", e->name, key, r);
+}
+
+/*===========================================================================*
+ *                             sge_tx_reclaim                                *
+ *===========================================================================*/
+static void sge_tx_reclaim(e)
+sge_t *e;
+{
+	sge_desc_t *desc;
+
+	/* Walk from the oldest descriptor until one still owned by the card. */
+	while (e->tx_inuse > 0)
+	{
+		desc = &e->tx_desc[e->dirty_tx];
+		if (desc->status & SGE_TXSTATUS_TXOWN)
+			break;
+
+		desc->status = 0;
+		desc->flags &= SGE_DESC_FINAL;
+		if (e->tx_prio && e->tx_prio[e->dirty_tx])
+			e->stats.tx_prio_done++;
+		e->dirty_tx = (e->dirty_tx + 1) % e->tx_desc_nr;
+		e->tx_inuse--;
+		e->stats.tx_done++;
+	}
+}
+
+/*===========================================================================*
+ *                              sge_tx_flush                                 *
+ *===========================================================================*/
+static void sge_tx_flush(e)
+sge_t *e;
+{
+	sge_t *p;
+	char *buf;
+	uint32_t slot;
+	int rung = 0;
+
+	/*
+	 * The packet generator has the ring to itself while it runs, and
+	 * nothing goes while the link partner has us paused.
+	 */
+	if (!(e->autoneg_done || (e->peer && e->peer->autoneg_done)) ||
+		SGE_PG_ACTIVE(e) || sge_tx_paused(e))
+	{
+		return;
+	}
+
+	/* Submit backlogged frames as a burst, with one doorbell per ring. */
+	while (e->prioq_tail != e->prioq_head)
+	{
+		slot = e->prioq_head % SGE_PRIOQ_NR;
+		buf = e->prioq_buf + (slot * SGE_BUF_SIZE);
+		p = sge_lag_pick(e, (uint8_t *) buf, e->prioq_len[slot]);
+		if (p->tx_inuse >= p->tx_desc_nr)
+			break;
+		memcpy(p->tx_buffer + ((p->cur_tx % p->tx_desc_nr) * SGE_BUF_SIZE),
+			buf, e->prioq_len[slot]);
+		sge_tx_post(p, e->prioq_len[slot], SGE_TXO_PRIO);
+		e->prioq_head++;
+		rung |= (p == e) ? 1 : 2;
+	}
+	while (e->txq_tail != e->txq_head)
+	{
+		slot = e->txq_head % e->txq_depth;
+		buf = e->txq_buf + (slot * SGE_BUF_SIZE);
+		p = sge_lag_pick(e, (uint8_t *) buf, e->txq_len[slot]);
+		if (p->tx_inuse >= p->tx_desc_nr - p->prio_reserve)
+			break;
+		memcpy(p->tx_buffer + ((p->cur_tx % p->tx_desc_nr) * SGE_BUF_SIZE),
+			buf, e->txq_len[slot]);
+		sge_tx_post(p, e->txq_len[slot], SGE_TXO_CLIENT);
+		e->txq_head++;
+		rung |= (p == e) ? 1 : 2;
+	}
+	if (rung & 1)
+		sge_reg_set(e, SGE_REG_TX_CTL, 0x10);
+	if (rung & 2)
+		sge_reg_set(e->peer, SGE_REG_TX_CTL, 0x10);
+}
+
+#if SGE_PKTGEN
+/*===========================================================================*
+ *                            sge_pktgen_start                               *
+ *===========================================================================*/
+static void sge_pktgen_start(e)
+sge_t *e;
+{
+	uint8_t *buf;
+	int i;
+
+	if (!(e->status & SGE_ENABLED) || !e->autoneg_done)
+	{
+		printf("%s: pktgen needs an active link\n", e->name);
+		return;
+	}
+
+	/* Pressed again: stop posting, and report once the ring drains. */
+	if (e->pg_active)
+	{
+		e->pg_target = e->pg_posted;
+		return;
+	}
+
+	/* The buffers below may still hold client frames owned by the card. */
+	sge_tx_reclaim(e);
+	if (e->tx_inuse)
+	{
+		printf("%s: pktgen waits for %u client frames in flight, "
+			"try again\n", e->name, e->tx_inuse);
+		return;
+	}
+
+	/*
+	 * Prebuild a frame in every TX buffer. They are addressed to
+	 * ourselves, so a switch drops them at our own port. Client frames
+	 * wait in the backlog until the run is over.
+	 */
+	for (i = 0; i < e->tx_desc_nr; i++)
+	{
+		buf = (uint8_t *) e->tx_buffer + (i * SGE_BUF_SIZE);
+		memset(buf, 0, e->pg_size);
+		memcpy(buf, e->address.ea_addr, 6);
+		memcpy(buf + 6, e->address.ea_addr, 6);
+		buf[12] = SGE_PKTGEN_TYPE >> 8;
+		buf[13] = SGE_PKTGEN_TYPE & 0xff;
+	}
+
+	e->pg_target = e->pg_count;
+	e->pg_posted = 0;
+	e->pg_done_base = e->stats.tx_done + e->stats.tx_lost;
+	e->pg_active = TRUE;
+	read_tsc_64(&e->pg_start);
+	e->pg_last = e->pg_start;
+
+	printf("%s: pktgen sending %u frames of %u bytes", e->name,
+		e->pg_target, e->pg_size);
+	if (e->pg_rate)
+		printf(" at %u pps", e->pg_rate);
+	printf("\n");
+
+	sge_pktgen_fill(e);
+	sge_alarm(e);
+}
+
+/*===========================================================================*
+ *                             sge_pktgen_run                                *
+ *===========================================================================*/
+static void sge_pktgen_run(e)
+sge_t *e;
+{
+	uint64_t done, cycles, khz;
+
+	sge_tx_reclaim(e);
+	done = e->stats.tx_done + e->stats.tx_lost - e->pg_done_base;
+	read_tsc_64(&e->pg_last);
+
+	if (e->pg_posted < e->pg_target)
+	{
+		sge_pktgen_fill(e);
+		return;
+	}
+	if (done < e->pg_target)
+		return;
+
+	/* Rates over the whole run, from first post to last completion. */
+	cycles = e->pg_last - e->pg_start;
+	khz = tsc_get_khz();
+	if (cycles == 0)
+		cycles = 1;
+	e->pg_pps = ((uint64_t) e->pg_target * khz * 1000) / cycles;
+	e->pg_bps = e->pg_pps * e->pg_size * 8;
+	e->pg_active = FALSE;
+
+	printf("%s: pktgen sent %u frames in %llu us: %llu pps, %llu bps\n",
+		e->name, e->pg_target, (cycles * 1000) / khz, e->pg_pps, e->pg_bps);
+
+	/* Hand the ring back to the client. */
+	sge_writev_s(&e->tx_message, TRUE);
+}
+
+/*===========================================================================*
+ *                            sge_pktgen_fill                                *
+ *===========================================================================*/
+static void sge_pktgen_fill(e)
+sge_t *e;
+{
+	uint8_t *buf;
+	uint64_t allowed;
+	uint32_t seq;
+	int n = 0;
+
+	/* Frames the rate limit lets us have posted by now. */
+	allowed = e->pg_target;
+	if (e->pg_rate)
+	{
+		allowed = ((e->pg_last - e->pg_start) * e->pg_rate) /
+			((uint64_t) tsc_get_khz() * 1000) + 1;
+	}
+
+	/* Top the ring up with prebuilt frames; only the sequence changes. */
+	while (e->pg_posted < e->pg_target && e->pg_posted < allowed &&
+		e->tx_inuse < e->tx_desc_nr)
+	{
+		buf = (uint8_t *) e->tx_buffer +
+			((e->cur_tx % e->tx_desc_nr) * SGE_BUF_SIZE);
+		seq = e->pg_posted;
+		buf[ETH_HDR_SIZE + 0] = seq >> 24;
+		buf[ETH_HDR_SIZE + 1] = seq >> 16;
+		buf[ETH_HDR_SIZE + 2] = seq >> 8;
+		buf[ETH_HDR_SIZE + 3] = seq;
+		sge_tx_post(e, e->pg_size, SGE_TXO_PKTGEN);
+		e->pg_posted++;
+		n++;
+	}
+	if (n)
+		sge_reg_set(e, SGE_REG_TX_CTL, 0x10);
+}
+#endif
+
+#if SGE_SELFTEST
+/*===========================================================================*
+ *                              sge_selftest                                 *
+ *===========================================================================*/
+static void sge_selftest(e)
+sge_t *e;
+{
+	sge_stats_t stats;
+	uint64_t *lat, pct[SGE_PCT_NR];
+	uint64_t start, now, stamp, wait, khz;
+	uint16_t ctl;
+	uint32_t seq, rseq, sent, got, lost;
+	int speed, duplex, i;
+
+	if ((lat = malloc(e->selftest_nr * sizeof(*lat))) == NULL)
+	{
+		printf("%s: no memory for the self-test\n", e->name);
+		return;
+	}
+
+	/*
+	 * Loop the PHY back on itself at 100 Mbps full duplex, and poll with
+	 * interrupts masked. No link partner is needed. The test frames are
+	 * not the client's, so its counters are put back afterwards.
+	 */
+	stats = e->stats;
+	sge_reg_write(e, SGE_REG_INTRMASK, 0);
+	ctl = sge_mii_read(e, e->cur_phy, SGE_MIIADDR_CONTROL);
+	sge_mii_write(e, e->cur_phy, SGE_MIIADDR_CONTROL,
+		SGE_MIICTRL_LOOPBACK | SGE_MIICTRL_SPEED100 | SGE_MIICTRL_FDX);
+	speed = e->link_speed;
+	duplex = e->duplex_mode;
+	e->link_speed = SGE_SPEED_100;
+	e->duplex_mode = SGE_DUPLEX_ON;
+	sge_macmode(e);
+	micro_delay(1000);
+
+	khz = tsc_get_khz();
+	wait = (khz * SGE_SELFTEST_WAIT_US) / 1000;
+
+	/* Latency: one frame at a time, stamped as it goes on the ring. */
+	got = lost = 0;
+	for (seq = 0; seq < e->selftest_nr; seq++)
+	{
+		if (!sge_selftest_send(e, seq))
+		{
+			lost++;
+			continue;
+		}
+		sge_reg_set(e, SGE_REG_TX_CTL, 0x10);
+		read_tsc_64(&start);
+
+		for (;;)
+		{
+			if (!sge_selftest_recv(e, &rseq, &stamp, start + wait))
+			{
+				lost++;
+				break;
+			}
+			if (rseq != seq)
+				continue;
+			read_tsc_64(&now);
+			lat[got++] = now - stamp;
+			break;
+		}
+	}
+
+	if (got)
+	{
+		sge_percentiles(lat, got, pct);
+		for (i = 0; i < SGE_PCT_NR; i++)
+			pct[i] = (pct[i] * 1000000) / khz;
+		printf("%s: loopback latency over %u frames (%u lost): "
+			"p50 %llu ns, p90 %llu ns, p99 %llu ns, max %llu ns\n",
+			e->name, got, lost, pct[SGE_PCT_50], pct[SGE_PCT_90],
+			pct[SGE_PCT_99], pct[SGE_PCT_MAX]);
+	}
+	else
+	{
+		printf("%s: loopback self-test failed, no frame came back\n",
+			e->name);
+	}
+
+	/* Throughput: keep the ring full and harvest as fast as we can. */
+	sent = got = 0;
+	if (lost < e->selftest_nr)
+	{
+		read_tsc_64(&start);
+		now = start;
+		while (got < e->selftest_nr)
+		{
+			while (sent < e->selftest_nr && sge_selftest_send(e, sent))
+				sent++;
+			sge_reg_set(e, SGE_REG_TX_CTL, 0x10);
+
+			if (!sge_selftest_recv(e, &rseq, &stamp, now + wait))
+				break;
+			read_tsc_64(&now);
+			got++;
+		}
+		if (now > start && got)
+		{
+			printf("%s: loopback RX harvest %llu pps over %u frames\n",
+				e->name, ((uint64_t) got * khz * 1000) / (now - start),
+				got);
+		}
+	}
+	free(lat);
+
+	/* Back to the wire, and renegotiate. */
+	sge_tx_reclaim(e);
+	e->link_speed = speed;
+	e->duplex_mode = duplex;
+	sge_mii_write(e, e->cur_phy, SGE_MIIADDR_CONTROL,
+		(ctl & ~SGE_MIICTRL_LOOPBACK) | SGE_MIICTRL_AUTO |
+		SGE_MIICTRL_RST_AUTO);
+	e->autoneg_done = 0;
+	for (i = 0; i < SGE_SELFTEST_AUTONEG_MS; i++)
+	{
+		if (sge_mii_read(e, e->cur_phy, SGE_MIIADDR_STATUS) &
+			SGE_MIISTATUS_AUTO_DONE)
+		{
+			sge_phymode(e);
+			break;
+		}
+		micro_delay(1000);
+	}
+	sge_macmode(e);
+
+	/* Late test frames must not reach the client. */
+	while (sge_rx_next(e) != NULL)
+		sge_rx_rearm(e, e->cur_rx);
+	sge_reg_set(e, SGE_REG_RX_CTL, 0x10);
+	sge_tx_reclaim(e);
+	e->stats = stats;
+
+	sge_reg_write(e, SGE_REG_INTRSTATUS, 0xffffffff);
+	sge_reg_write(e, SGE_REG_INTRMASK, SGE_INTR_MASK(e));
+}
+
+/*===========================================================================*
+ *                           sge_selftest_send                               *
+ *===========================================================================*/
+static int sge_selftest_send(e, seq)
+sge_t *e;
+uint32_t seq;
+{
+	uint8_t *buf;
+	uint64_t tsc;
+
+	sge_tx_reclaim(e);
+	if (e->tx_inuse >= e->tx_desc_nr)
+		return FALSE;
+
+	/* To ourselves: magic, sequence number and TSC at posting. */
+	buf = (uint8_t *) e->tx_buffer +
+		((e->cur_tx % e->tx_desc_nr) * SGE_BUF_SIZE);
+	memset(buf, 0, ETH_MIN_PACK_SIZE);
+	memcpy(buf, e->address.ea_addr, 6);
+	memcpy(buf + 6, e->address.ea_addr, 6);
+	buf[12] = SGE_PKTGEN_TYPE >> 8;
+	buf[13] = SGE_PKTGEN_TYPE & 0xff;
+	read_tsc_64(&tsc);
+	*(uint32_t *)(buf + ETH_HDR_SIZE) = SGE_SELFTEST_MAGIC;
+	*(uint32_t *)(buf + ETH_HDR_SIZE + 4) = seq;
+	memcpy(buf + ETH_HDR_SIZE + 8, &tsc, sizeof(tsc));
+
+	sge_tx_post(e, ETH_MIN_PACK_SIZE, SGE_TXO_CLIENT);
+	return TRUE;
+}
+
+/*===========================================================================*
+ *                           sge_selftest_recv                               *
+ *===========================================================================*/
+static int sge_selftest_recv(e, seq, stamp, deadline)
+sge_t *e;
+uint32_t *seq;
+uint64_t *stamp;
+uint64_t deadline;
+{
+	sge_desc_t *desc;
+	uint8_t *buf;
+	uint64_t now;
+	uint32_t current;
+	int ours;
+
+	/* Poll the ring for one of our frames, until the deadline. */
+	for (;;)
+	{
+		if ((desc = sge_rx_next(e)) != NULL)
+		{
+			current = e->cur_rx;
+			buf = (uint8_t *) e->rx_buffer + (current * SGE_BUF_SIZE);
+			ours = (desc->pkt_size & 0xffff) >= ETH_HDR_SIZE + 16 &&
+				*(uint32_t *)(buf + ETH_HDR_SIZE) == SGE_SELFTEST_MAGIC;
+			if (ours)
+			{
+				*seq = *(uint32_t *)(buf + ETH_HDR_SIZE + 4);
+				memcpy(stamp, buf + ETH_HDR_SIZE + 8, sizeof(*stamp));
+			}
+			sge_rx_rearm(e, current);
+			sge_reg_set(e, SGE_REG_RX_CTL, 0x10);
+			if (ours)
+				return TRUE;
+			continue;
+		}
+
+		read_tsc_64(&now);
+		if (now >= deadline)
+			return FALSE;
+	}
+}
+#endif
+
+#if SGE_SELFTEST || SGE_RX_DWELL
+/*===========================================================================*
+ *                            sge_percentiles                                *
+ *===========================================================================*/
+static void sge_percentiles(v, n, pct)
+uint64_t *v;
+int n;
+uint64_t *pct;
+{
+	/* Sorts the samples in place. */
+	qsort(v, n, sizeof(*v), sge_cmp_u64);
+
+	pct[SGE_PCT_50] = v[(n * 50) / 100];
+	pct[SGE_PCT_90] = v[(n * 90) / 100];
+	pct[SGE_PCT_99] = v[(n * 99) / 100];
+	pct[SGE_PCT_MAX] = v[n - 1];
+}
+
+/*===========================================================================*
+ *                              sge_cmp_u64                                  *
+ *===========================================================================*/
+static int sge_cmp_u64(a, b)
+const void *a;
+const void *b;
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+#endif
+
+/*===========================================================================*
+ *                              sge_fc_send                                  *
+ *===========================================================================*/
+static int sge_fc_send(e, quanta)
+sge_t *e;
+uint16_t quanta;
+{
+	static const uint8_t pause_addr[6] = { 0x01, 0x80, 0xc2, 0, 0, 1 };
+	uint8_t *buf;
+
+	/*
+	 * Control frames skip the backlog, and any pause of our own, but
+	 * not the generator: it resends whatever its buffers hold.
+	 */
+	sge_tx_reclaim(e);
+	if (!e->autoneg_done || SGE_PG_ACTIVE(e) ||
+		e->tx_inuse >= e->tx_desc_nr)
+	{
+		return FALSE;
+	}
+
+	buf = (uint8_t *) e->tx_buffer +
+		((e->cur_tx % e->tx_desc_nr) * SGE_BUF_SIZE);
+	memset(buf, 0, ETH_MIN_PACK_SIZE);
+	memcpy(buf, pause_addr, 6);
+	memcpy(buf + 6, e->address.ea_addr, 6);
+	buf[12] = SGE_ETHERTYPE_MAC_CTL >> 8;
+	buf[13] = SGE_ETHERTYPE_MAC_CTL & 0xff;
+	buf[14] = SGE_PAUSE_OPCODE >> 8;
+	buf[15] = SGE_PAUSE_OPCODE & 0xff;
+	buf[16] = quanta >> 8;
+	buf[17] = quanta & 0xff;
+
+	sge_tx_post(e, ETH_MIN_PACK_SIZE, SGE_TXO_CTRL);
+	sge_reg_set(e, SGE_REG_TX_CTL, 0x10);
+	e->stats.tx_pause++;
+
+	return TRUE;
+}
+
+/*===========================================================================*
+ *                              sge_fc_recv                                  *
+ *===========================================================================*/
+static int sge_fc_recv(e, buf, len)
+sge_t *e;
+uint8_t *buf;
+size_t len;
+{
+	uint64_t now;
+	uint32_t quanta;
+
+	/* Returns TRUE for MAC control frames, which are ours to consume. */
+	if (len < ETH_HDR_SIZE + 4 ||
+		((buf[12] << 8) | buf[13]) != SGE_ETHERTYPE_MAC_CTL)
+	{
+		return FALSE;
+	}
+	if (((buf[14] << 8) | buf[15]) != SGE_PAUSE_OPCODE)
+		return TRUE;
+
+	e->stats.rx_pause++;
+	if (!e->fc_rx)
+		return TRUE;
+
+	/* One quantum is 512 bit times; zero resumes at once. */
+	quanta = (buf[16] << 8) | buf[17];
+	read_tsc_64(&now);
+	e->fc_resume = now + ((uint64_t) quanta * 512 * tsc_get_khz()) /
+		((uint64_t) e->link_speed * 1000);
+	e->fc_paused = (quanta != 0);
+	if (e->fc_paused)
+		sge_alarm(e);
+
+	return TRUE;
+}
+
+/*===========================================================================*
+ *                            sge_fc_pressure                                *
+ *===========================================================================*/
+static void sge_fc_pressure(e)
+sge_t *e;
+{
+	uint64_t now;
+	uint32_t queued;
+
+	if (!e->fc_tx || !e->rxq_depth)
+		return;
+
+	/*
+	 * Ask the partner to hold off while the RX queue is three quarters
+	 * full, and to resume once it has drained to a quarter. XOFF is sent
+	 * again halfway through its quanta, for as long as we stay above a
+	 * quarter. State changes only once a frame is posted; a send that
+	 * found no room is retried on the next call.
+	 */
+	queued = e->rxq_tail - e->rxq_head;
+	read_tsc_64(&now);
+	if (e->fc_xoff && queued <= e->rxq_depth / 4)
+	{
+		if (sge_fc_send(e, 0))
+			e->fc_xoff = FALSE;
+	}
+	else if ((!e->fc_xoff && queued >= (e->rxq_depth * 3) / 4) ||
+		(e->fc_xoff && now >= e->fc_refresh))
+	{
+		if (sge_fc_send(e, SGE_PAUSE_QUANTA))
+		{
+			e->fc_xoff = TRUE;
+			e->fc_refresh = now + ((uint64_t) SGE_PAUSE_QUANTA * 512 *
+				tsc_get_khz()) / ((uint64_t) e->link_speed * 1000 * 2);
+		}
+	}
+}
+
+/*===========================================================================*
+ *                             sge_tx_paused                                 *
+ *===========================================================================*/
+static int sge_tx_paused(e)
+sge_t *e;
+{
+	uint64_t now;
+
+	if (!e->fc_paused)
+		return FALSE;
+
+	read_tsc_64(&now);
+	if (now < e->fc_resume)
+		return TRUE;
+
+	e->fc_paused = FALSE;
+	return FALSE;
+}
+
+/*===========================================================================*
+ *                              sge_lag_pick                                 *
+ *===========================================================================*/
+static sge_t *sge_lag_pick(e, buf, len)
+sge_t *e;
+uint8_t *buf;
+size_t len;
+{
+	sge_t *p = e->peer;
+	int up, peer_up;
+
+	if (p == NULL)
+		return e;
+
+	/* Fail over to whichever port still has a link. */
+	up = e->autoneg_done && e->link_up;
+	peer_up = p->autoneg_done && p->link_up;
+	if (up != peer_up)
+		return peer_up ? p : e;
+
+	return (sge_lag_hash(e->lag_hash, buf, len) & 1) ? p : e;
+}
+
+/*===========================================================================*
+ *                              sge_lag_hash                                 *
+ *===========================================================================*/
+static uint32_t sge_lag_hash(layers, buf, len)
+int layers;
+uint8_t *buf;
+size_t len;
+{
+	uint32_t h = 0, type, off, ihl;
+	int i;
+
+	/* Frames of one flow always hash alike, so they stay in order. */
+	if (len < ETH_HDR_SIZE)
+		return 0;
+	for (i = 0; i < 12; i++)
+		h ^= (uint32_t) buf[i] << ((i & 3) * 8);
+
+	type = (buf[12] << 8) | buf[13];
+	off = ETH_HDR_SIZE;
+	if (type == SGE_ETHERTYPE_VLAN && len >= ETH_HDR_SIZE + 4)
+	{
+		type = (buf[16] << 8) | buf[17];
+		off += 4;
+	}
+
+	if (layers >= SGE_LAG_L3 && type == SGE_ETHERTYPE_IP && len >= off + 20)
+	{
+		for (i = 12; i < 20; i++)
+			h ^= (uint32_t) buf[off + i] << ((i & 3) * 8);
+
+		/* Ports, unless this is a fragment. */
+		ihl = (buf[off] & 0x0f) * 4;
+		if (layers >= SGE_LAG_L4 && len >= off + ihl + 4 &&
+			!(((buf[off + 6] & 0x3f) << 8) | buf[off + 7]) &&
+			(buf[off + 9] == SGE_IPPROTO_TCP ||
+			buf[off + 9] == SGE_IPPROTO_UDP))
+		{
+			for (i = 0; i < 4; i++)
+				h ^= (uint32_t) buf[off + ihl + i] << ((i & 3) * 8);
+		}
+	}
+
+	h ^= h >> 16;
+	h ^= h >> 8;
+	return h;
+}
+
+/*===========================================================================*
+ *                              sge_lag_link                                 *
+ *===========================================================================*/
+static void sge_lag_link(p)
+sge_t *p;
+{
+	u16_t status;
+	int up;
+
+	if (p->mii == NULL)
+		return;
+
+	status = sge_mii_read(p, p->cur_phy, SGE_MIIADDR_STATUS);
+	status = sge_mii_read(p, p->cur_phy, SGE_MIIADDR_STATUS);
+	up = (status & SGE_MIISTATUS_LINK) != 0;
+	if (up == p->link_up)
+		return;
+
+	/* Coming back, the partner may have negotiated something else. */
+	if (up && (status & SGE_MIISTATUS_AUTO_DONE))
+	{
+		sge_phymode(p);
+		sge_macmode(p);
+	}
+	p->link_up = up;
+	printf("%s: link %s\n", p->name, up ? "up" : "down, failing over");
+
+	/* Whatever waits in the backlog now goes to the port still up. */
+	if (sge_state.status & SGE_ENABLED)
+		sge_writev_s(&sge_state.tx_message, TRUE);
+}
+
+/*===========================================================================*
+ *                              sge_readv_s                                  *
+ *===========================================================================*/
+static void sge_readv_s(mp, from_int)
+message *mp;
+int from_int;
+{
+	sge_t *e = &sge_state;
+	sge_desc_t *desc;
+	uint32_t current;
+
+	/* Are we called from the interrupt handler? */
+	if (!from_int)
+	{
+		/* Copy read message. */
+		e->rx_message = *mp;
+		e->client = mp->m_source;
+		e->status |= SGE_READING;
+		e->rx_size = 0;
+		e->rx_iovec_valid = FALSE;
+	}
+
+	if (e->status & SGE_READING)
+	{
+		/*
+		 * Copy the I/O vector table, once per request. Interrupts
+		 * completing the same request reuse it.
+		 */
+		if (!e->rx_iovec_valid)
+		{
+			sge_iovec_fetch(e, &e->rx_message,
+				e->rx_message.m_net_netdrv_dl_readv_s.grant,
+				e->rx_message.m_net_netdrv_dl_readv_s.count, e->rx_iovec);
+			e->stats.rx_copy_bytes +=
+				e->rx_message.m_net_netdrv_dl_readv_s.count *
+				sizeof(iovec_s_t);
+			e->rx_iovec_valid = TRUE;
+		}
+
+		/* Aggregated, the other port's frames only arrive through here. */
+		if (e->peer && e->rxq_tail == e->rxq_head)
+			sge_rx_harvest(e);
+
+		if (e->rxq_tail != e->rxq_head)
+		{
+			/* Staged frames go first, to keep them in order. */
+			current = e->rxq_head % e->rxq_depth;
+			sge_rx_copy(e, e->rxq_buf + (current * SGE_BUF_SIZE),
+				e->rxq_len[current], e->rxq_status[current],
+				e->rxq_stamp[current]);
+			e->rxq_head++;
+
+			/*
+			 * Refill the slot from the rings. With the queue full,
+			 * they may hold frames no interrupt will report, and
+			 * the card needs those descriptors back to go on.
+			 */
+			sge_rx_harvest(e);
+		}
+		else
+		{
+			/* Select a good packet not owned by the card. */
+			desc = sge_rx_next(e);
+
+			/* Give up if none found. */
+			if (desc == NULL)
+			{
+				return;
+			}
+			current = e->cur_rx;
+
+			sge_rx_copy(e, e->rx_buffer + (current * SGE_BUF_SIZE),
+				desc->pkt_size & 0xffff, desc->status, e->rx_seen);
+
+			/* Flip ownership back to the card, and reenable. */
+			sge_rx_rearm(e, current);
+			sge_reg_set(e, SGE_REG_RX_CTL, 0x10);
+		}
+	}
+
+	/* Stage whatever is left, so the card gets its descriptors back. */
+	if (from_int)
+		sge_rx_harvest(e);
+
+	reply(e);
+}
+
+/*===========================================================================*
+ *                              sge_rx_copy                                  *
+ *===========================================================================*/
+static void sge_rx_copy(e, buf, len, status, seen)
+sge_t *e;
+char *buf;
+size_t len;
+uint32_t status;
+#if SGE_RX_DWELL
+uint64_t seen;
+#else
+uint64_t UNUSED(seen);
+#endif
+{
+	iovec_s_t *iovec = e->rx_iovec;
+	int r, i;
+	size_t bytes = 0, size;
+
+	/* Copy to vector elements. */
+	for (i = 0; i < e->rx_message.m_net_netdrv_dl_readv_s.count &&
+		bytes < len; i++)
+	{
+		size = iovec[i].iov_size < (len - bytes) ?
+			iovec[i].iov_size : (len - bytes);
+
+		if ((r = sys_safecopyto(e->rx_message.m_source, iovec[i].iov_grant,
+			0, (vir_bytes) buf + bytes, size)) != OK)
+		{
+			panic("sys_safecopyto() failed: %d", r);
+		}
+		bytes += size;
+	}
+
+	/* Runts are reported padded; a stamp goes after the padding. */
+	e->rx_size = bytes >= ETH_MIN_PACK_SIZE ? bytes : ETH_MIN_PACK_SIZE;
+	e->rx_stamp_ok = FALSE;
+#if SGE_RX_DWELL
+	if (e->caps & SGE_CAP_RXSTAMP)
+	{
+		e->rx_stamp_ok = sge_rx_stamp(e, e->rx_size, seen);
+		if (!e->rx_stamp_ok)
+			e->stats.rx_stamp_short++;
+	}
+
+	/* Time from first sight to delivery, into the sample window. */
+	if (e->dwell_on)
+	{
+		uint64_t now;
+
+		read_tsc_64(&now);
+		e->dwell[e->dwell_idx % SGE_DWELL_NR] = now - seen;
+		e->dwell_idx++;
+	}
+#endif
+
+#if SGE_CAPTURE
+	if (e->cap_ring)
+		sge_capture(e, buf, bytes);
+#endif
+
+	e->rx_csum_ok = (e->caps & SGE_CAP_RXCSUM) && sge_rx_csum(e, status);
+	e->status |= SGE_RECEIVED;
+	e->stats.rx_packets++;
+	e->stats.rx_bytes += bytes;
+	e->stats.rx_copy_bytes += bytes;
+}
+
+#if SGE_RX_DWELL
+/*===========================================================================*
+ *                              sge_rx_stamp                                 *
+ *===========================================================================*/
+static int sge_rx_stamp(e, off, stamp)
+sge_t *e;
+size_t off;
+uint64_t stamp;
+{
+	iovec_s_t *iovec = e->rx_iovec;
+	size_t done = 0, room = 0, size;
+	int r, i;
+
+	/*
+	 * The TSC at first sight goes right after the frame, outside the
+	 * reported length, wherever the client's vector has room for it.
+	 * Without room for all of it, none is written and the reply says so.
+	 */
+	for (i = 0; i < e->rx_message.m_net_netdrv_dl_readv_s.count; i++)
+		room += iovec[i].iov_size;
+	if (room < off + sizeof(stamp))
+		return FALSE;
+
+	for (i = 0; i < e->rx_message.m_net_netdrv_dl_readv_s.count &&
+		done < sizeof(stamp); i++)
+	{
+		if (off >= iovec[i].iov_size)
+		{
+			off -= iovec[i].iov_size;
+			continue;
+		}
+		size = iovec[i].iov_size - off < sizeof(stamp) - done ?
+			iovec[i].iov_size - off : sizeof(stamp) - done;
+		if ((r = sys_safecopyto(e->rx_message.m_source, iovec[i].iov_grant,
+			off, (vir_bytes) &stamp + done, size)) != OK)
+		{
+			panic("sys_safecopyto() failed: %d", r);
+		}
+		done += size;
+		off = 0;
+	}
+
+	return TRUE;
+}
+
+/*===========================================================================*
+ *                              sge_rx_mark                                  *
+ *===========================================================================*/
+static void sge_rx_mark(e)
+sge_t *e;
+{
+	uint64_t now;
+	uint32_t i;
+
+	/*
+	 * Stamp the frames completed since the last look, once each. The
+	 * rx_stamped descriptors from cur_rx on already carry their stamp.
+	 */
+	read_tsc_64(&now);
+	while (e->rx_stamped < e->rx_desc_nr)
+	{
+		i = (e->cur_rx + e->rx_stamped) % e->rx_desc_nr;
+		if (e->rx_desc[i].status & SGE_RXSTATUS_RXOWN)
+			break;
+		e->rx_stamps[i] = now;
+		e->rx_stamped++;
+	}
+}
+
+/*===========================================================================*
+ *                              sge_rx_dwell                                 *
+ *===========================================================================*/
+static void sge_rx_dwell(e)
+sge_t *e;
+{
+	uint64_t khz;
+	int i, n;
+
+	/* Percentiles over the window, in nanoseconds. */
+	n = e->dwell_idx < SGE_DWELL_NR ? e->dwell_idx : SGE_DWELL_NR;
+	if (n == 0 || (khz = tsc_get_khz()) == 0)
+		return;
+
+	memcpy(e->dwell_tmp, e->dwell, n * sizeof(e->dwell[0]));
+	sge_percentiles(e->dwell_tmp, n, e->dwell_pct);
+	for (i = 0; i < SGE_PCT_NR; i++)
+		e->dwell_pct[i] = (e->dwell_pct[i] * 1000000) / khz;
+}
+#endif
+
+/*===========================================================================*
+ *                              sge_rx_vlan                                  *
+ *===========================================================================*/
+static int sge_rx_vlan(e, desc, buf)
+sge_t *e;
+sge_desc_t *desc;
+uint8_t *buf;
+{
+	uint32_t len = desc->pkt_size & SGE_RXINFO_SIZE;
+	uint16_t tag, vid;
+
+	if (desc->pkt_size & SGE_RXINFO_TAGON)
+	{
+		/* Stripped by the card. */
+		tag = desc->status & SGE_DESC_VLAN_MASK;
+	}
+	else if (len >= ETH_HDR_SIZE + 4 &&
+		((buf[12] << 8) | buf[13]) == SGE_ETHERTYPE_VLAN)
+	{
+		tag = (buf[14] << 8) | buf[15];
+	}
+	else
+	{
+		/* Untagged frames always pass. */
+		return TRUE;
+	}
+
+	/* Priority tagged frames (VID 0) belong to the native VLAN. */
+	vid = tag & SGE_VLAN_ID_MASK;
+	if (vid != 0 && !(e->vlan_map[vid / 32] & (1U << (vid % 32))))
+	{
+		e->stats.rx_vlan_drop++;
+		return FALSE;
+	}
+
+	/* Frames on other VLANs than the native one keep their tag. */
+	if ((desc->pkt_size & SGE_RXINFO_TAGON) && vid != 0 &&
+		vid != e->vlan_pvid &&
+		len + 4 <= SGE_BUF_SIZE)
+	{
+		memmove(buf + 16, buf + 12, len - 12);
+		buf[12] = SGE_ETHERTYPE_VLAN >> 8;
+		buf[13] = SGE_ETHERTYPE_VLAN & 0xff;
+		buf[14] = tag >> 8;
+		buf[15] = tag & 0xff;
+		desc->pkt_size = (desc->pkt_size &
+			~(SGE_RXINFO_TAGON | SGE_RXINFO_SIZE)) | (len + 4);
+	}
+
+	return TRUE;
+}
+
+/*===========================================================================*
+ *                              sge_rx_csum                                  *
+ *===========================================================================*/
+static int sge_rx_csum(e, status)
+sge_t *e;
+uint32_t status;
+{
+	/* Only IPv4 frames the card recognized are reported. */
+	if (!(status & SGE_RXSTATUS_IPON))
+		return FALSE;
+	if (!(status & SGE_RXSTATUS_IPOK))
+	{
+		e->stats.rx_ipcsum_bad++;
+		return FALSE;
+	}
+	if (((status & SGE_RXSTATUS_TCPON) && !(status & SGE_RXSTATUS_TCPOK)) ||
+		((status & SGE_RXSTATUS_UDPON) && !(status & SGE_RXSTATUS_UDPOK)))
+	{
+		e->stats.rx_l4csum_bad++;
+		return FALSE;
+	}
+	if (!(status & (SGE_RXSTATUS_TCPON | SGE_RXSTATUS_UDPON)))
+		return FALSE;
+
+	e->stats.rx_csum_ok++;
+	return TRUE;
+}
+
+/*===========================================================================*
+ *                              sge_rx_rearm                                 *
+ *===========================================================================*/
+static void sge_rx_rearm(e, current)
+sge_t *e;
+uint32_t current;
+{
+	sge_desc_t *desc = &e->rx_desc[current];
+
+	/* Hand the descriptor back to the card, and move on. */
+	desc->pkt_size = 0;
+	desc->status = SGE_RXSTATUS_RXOWN | SGE_RXSTATUS_RXINT;
+	e->cur_rx = (current + 1) % e->rx_desc_nr;
+	if (e->rx_stamped)
+		e->rx_stamped--;
+}
+
+/*===========================================================================*
+ *                             sge_rx_harvest                                *
+ *===========================================================================*/
+static void sge_rx_harvest(e)
+sge_t *e;
+{
+	/* Move completed frames into the software queue, from every port. */
+	sge_rx_drain(e, e);
+	if (e->peer)
+		sge_rx_drain(e, e->peer);
+
+	if (e->rxq_depth && e->rxq_tail - e->rxq_head == e->rxq_depth)
+		e->stats.rxq_full++;
+	if (e->fc_tx)
+		sge_fc_pressure(e);
+	if (e->rxq_tail - e->rxq_head > e->rxq_max)
+		e->rxq_max = e->rxq_tail - e->rxq_head;
+}
+
+/*===========================================================================*
+ *                              sge_rx_drain                                 *
+ *===========================================================================*/
+static void sge_rx_drain(e, p)
+sge_t *e;
+sge_t *p;
+{
+	sge_desc_t *desc;
+	uint32_t current, slot, len;
+	int n = 0;
+
+	/* From the ring of port p into the queue of e. */
+	while (e->rxq_tail - e->rxq_head < e->rxq_depth)
+	{
+		if ((desc = sge_rx_next(p)) == NULL)
+			break;
+		current = p->cur_rx;
+
+		slot = e->rxq_tail % e->rxq_depth;
+		len = desc->pkt_size & 0xffff;
+		if (len > SGE_BUF_SIZE)
+			len = SGE_BUF_SIZE;
+		memcpy(e->rxq_buf + (slot * SGE_BUF_SIZE),
+			p->rx_buffer + (current * SGE_BUF_SIZE), len);
+		e->rxq_len[slot] = len;
+		e->rxq_status[slot] = desc->status;
+		e->rxq_stamp[slot] = p->rx_seen;
+		e->rxq_tail++;
+
+		sge_rx_rearm(p, current);
+		n++;
+	}
+	if (n == 0)
+		return;
+
+	e->stats.rx_staged += n;
+	sge_reg_set(p, SGE_REG_RX_CTL, 0x10);
+}
+
+/*===========================================================================*
+ *                             sge_rx_recover                                *
+ *===========================================================================*/
+static void sge_rx_recover(e)
+sge_t *e;
+{
+	/*
+	 * The receiver halts when it runs out of descriptors. Save what we
+	 * can into the software queue. Completed frames that do not fit stay
+	 * on the ring for later reads, whose rearm and doorbell restart the
+	 * card. Only a ring with nothing left to deliver is rebuilt, with
+	 * just the receive engine restarted.
+	 */
+	e->stats.rx_halts++;
+	sge_rx_drain(&sge_state, e);
+	if (!(e->rx_desc[e->cur_rx % e->rx_desc_nr].status & SGE_RXSTATUS_RXOWN))
+		return;
+
+	sge_reg_unset(e, SGE_REG_RX_CTL, 0x1);
+	sge_init_rx_ring(e);
+
+	sge_reg_set(e, SGE_REG_RX_CTL, 0x1 | 0x10);
+}
+
+/*===========================================================================*
+ *                              sge_rx_next                                  *
+ *===========================================================================*/
+static sge_desc_t *sge_rx_next(e)
+sge_t *e;
+{
+	sge_desc_t *desc;
+	uint8_t *buf;
+	int bad = 0;
+
+	/*
+	 * Return the next completed descriptor holding a good frame. Bad
+	 * frames are dropped here, before any copy or message is spent on
+	 * them, and their descriptors go straight back to the card.
+	 */
+#if SGE_RX_DWELL
+	if (e->dwell_on)
+		sge_rx_mark(e);
+#endif
+	for (;;)
+	{
+		desc = &e->rx_desc[e->cur_rx % e->rx_desc_nr];
+		if (desc->status & SGE_RXSTATUS_RXOWN)
+		{
+			desc = NULL;
+			break;
+		}
+		buf = (uint8_t *) e->rx_buffer +
+			((e->cur_rx % e->rx_desc_nr) * SGE_BUF_SIZE);
+		if (sge_rx_check(e, desc->pkt_size) &&
+			!sge_fc_recv(e, buf, desc->pkt_size & 0xffff) &&
+			(!e->vlan_filter || sge_rx_vlan(e, desc, buf)))
+		{
+			break;
+		}
+
+		sge_rx_rearm(e, e->cur_rx % e->rx_desc_nr);
+		bad++;
+	}
+	if (bad)
+		sge_reg_set(e, SGE_REG_RX_CTL, 0x10);
+	if (desc != NULL && SGE_DWELL_ON(e))
+		e->rx_seen = e->rx_stamps[e->cur_rx];
+
+	return desc;
+}
+
+/*===========================================================================*
+ *                              sge_rx_check                                 *
+ *===========================================================================*/
+static int sge_rx_check(e, info)
+sge_t *e;
+uint32_t info;
+{
+	if ((info & SGE_RXSTATUS_CRCOK) && !(info & SGE_RXSTATUS_ERRORS))
+		return TRUE;
+
+	/* Count the frame once, by its first reason. */
+	e->stats.rx_errors++;
+	if (!(info & SGE_RXSTATUS_CRCOK))
+		e->stats.rx_crc++;
+	else if (info & SGE_RXSTATUS_ABORT)
+		e->stats.rx_abort++;
+	else if (info & SGE_RXSTATUS_OVRUN)
+		e->stats.rx_overrun++;
+	else if (info & SGE_RXSTATUS_SHORT)
+		e->stats.rx_short++;
+	else if (info & SGE_RXSTATUS_LIMIT)
+		e->stats.rx_limit++;
+	else if (info & SGE_RXSTATUS_MIIER)
+		e->stats.rx_miier++;
+	else
+		e->stats.rx_frame++;
+
+	return FALSE;
+}
+
+/*===========================================================================*
+ *                            sge_iovec_fetch                                *
+ *===========================================================================*/
+static void sge_iovec_fetch(e, mp, grant, count, iovec)
+sge_t *e;
+message *mp;
+cp_grant_id_t grant;
+int count;
+iovec_s_t *iovec;
+{
+	int r;
+
+	if (count <= 0 || count > SGE_IOVEC_NR)
+	{
+		panic("%s: bad I/O vector count: %d", e->name, count);
+	}
+	if ((r = sys_safecopyfrom(mp->m_source, grant, 0, (vir_bytes) iovec,
+		count * sizeof(iovec_s_t))) != OK)
+	{
+		panic("sys_safecopyfrom() failed: %d", r);
+	}
+}
+
+/*===========================================================================*
+ *                             sge_getstat_s                                 *
+ *===========================================================================*/
+static void sge_getstat_s(mp)
+message *mp;
+{
+	int r;
+	eth_stat_t stats;
+	sge_t *e = &sge_state;
+
+	stats.ets_recvErr   = e->stats.rx_errors;
+	stats.ets_sendErr   = 0;
+	stats.ets_OVW       = e->stats.rx_overrun;
+	stats.ets_CRCerr    = e->stats.rx_crc;
+	stats.ets_frameAll  = e->stats.rx_frame;
+	stats.ets_missedP   = 0;
+	stats.ets_packetR   = e->stats.rx_packets;
+	stats.ets_packetT   = e->stats.tx_packets;
+	stats.ets_collision = 0;
+	stats.ets_transAb   = 0;
+	stats.ets_carrSense = 0;
+	stats.ets_fifoUnder = 0;
+	stats.ets_fifoOver  = 0;
+	stats.ets_CDheartbeat = 0;
+	stats.ets_OWC = 0;
+
+	/* Aggregated, errors and transmissions happen on both ports. */
+	if (e->peer)
+	{
+		stats.ets_recvErr  += e->peer->stats.rx_errors;
+		stats.ets_OVW      += e->peer->stats.rx_overrun;
+		stats.ets_CRCerr   += e->peer->stats.rx_crc;
+		stats.ets_frameAll += e->peer->stats.rx_frame;
+		stats.ets_packetT  += e->peer->stats.tx_packets;
+	}
+
+	sge_statpage_update(e);
+
+	sys_safecopyto(mp->m_source, mp->m_net_netdrv_dl_getstat_s.grant, 0,
+		(vir_bytes)&stats, sizeof(stats));
+	mp->m_type  = DL_STAT_REPLY;
+	if((r=ipc_send(mp->m_source, mp)) != OK)
+		panic("sge_getstat: ipc_send() failed: %d", r);
+}
+
+/*===========================================================================*
+ *                             sge_interrupt                                 *
+ *===========================================================================*/
+static void sge_interrupt(mp)
+message *mp;
+{
+	sge_t *e;
+	u32_t status, peer = 0;
+
+	/*
+	 * Check the card(s) for interrupt reason(s).
+	 */
+	e = &sge_state;
+
+	status = sge_intr_ack(e);
+	if (e->peer)
+		peer = sge_intr_ack(e->peer);
+
+#if SGE_RX_DWELL
+	/* A frame is first seen by its interrupt, not by the read taking it. */
+	if (e->dwell_on)
+	{
+		sge_rx_mark(e);
+		if (e->peer)
+			sge_rx_mark(e->peer);
+	}
+#endif
+
+	if (e->pipeline)
+	{
+		/*
+		 * Two stages: service the rings and hand the interrupt back,
+		 * then do the slow grant copies and replies. The RX queue
+		 * carries frames from the first stage to the second.
+		 */
+		sge_ring_stage(e, status, peer);
+		sge_intr_enable(e);
+		sge_client_stage(e, status | peer);
+		return;
+	}
+
+	sge_client_stage(e, (status | peer) & ~SGE_INTR_TX_HALT);
+	sge_intr_recover(e, status);
+	if (e->peer)
+		sge_intr_recover(e->peer, peer);
+	if ((status | peer) & SGE_INTR_TX_HALT)
+		sge_writev_s(&e->tx_message, TRUE);
+	sge_intr_enable(e);
+}
+
+/*===========================================================================*
+ *                             sge_ring_stage                                *
+ *===========================================================================*/
+static void sge_ring_stage(e, status, peer)
+sge_t *e;
+uint32_t status;
+uint32_t peer;
+{
+	/*
+	 * Everything the card waits on, and no client copies: take back
+	 * sent descriptors and refill them from the backlog, move received
+	 * frames to the RX queue and rearm, restart halted engines.
+	 */
+	if ((status | peer) & (SGE_INTR_TX_DONE | SGE_INTR_TX_IDLE))
+	{
+		sge_tx_reclaim(e);
+		if (e->peer)
+			sge_tx_reclaim(e->peer);
+		sge_tx_flush(e);
+	}
+	if ((status | peer) &
+		(SGE_INTR_RX_DONE | SGE_INTR_RX_IDLE | SGE_INTR_RX_HALT))
+	{
+		sge_rx_harvest(e);
+	}
+
+	sge_intr_recover(e, status);
+	if (e->peer)
+		sge_intr_recover(e->peer, peer);
+}
+
+/*===========================================================================*
+ *                            sge_client_stage                               *
+ *===========================================================================*/
+static void sge_client_stage(e, events)
+sge_t *e;
+uint32_t events;
+{
+	if (events & (SGE_INTR_TX_DONE | SGE_INTR_TX_IDLE | SGE_INTR_TX_HALT))
+	{
+		/* Tx interrupt */
+		e->stats.tx_intrs++;
+#if SGE_PKTGEN
+		if (e->pg_active)
+			sge_pktgen_run(e);
+		else
+#endif
+			sge_writev_s(&e->tx_message, TRUE);
+	}
+	if (events & (SGE_INTR_RX_DONE | SGE_INTR_RX_IDLE | SGE_INTR_RX_HALT))
+	{
+		/* Rx interrupt */
+		e->stats.rx_intrs++;
+		sge_readv_s(&e->rx_message, TRUE);
+	}
+}
+
+/*===========================================================================*
+ *                            sge_intr_enable                                *
+ *===========================================================================*/
+static void sge_intr_enable(e)
+sge_t *e;
+{
+	/* Re-enable interrupts. */
+	sge_reg_write(e, SGE_REG_INTRMASK, SGE_INTR_MASK(e));
+	if (sys_irqenable(&e->irq_hook) != OK)
+	{
+		panic("failed to re-enable IRQ");
+	}
+	if (e->peer)
+	{
+		sge_reg_write(e->peer, SGE_REG_INTRMASK, SGE_INTR_MASK(e->peer));
+		if (sys_irqenable(&e->peer->irq_hook) != OK)
+			panic("failed to re-enable IRQ");
+	}
+}
+
+/*===========================================================================*
+ *                              sge_intr_ack                                 *
+ *===========================================================================*/
+static uint32_t sge_intr_ack(p)
+sge_t *p;
+{
+	u32_t status;
+
+	status = sge_reg_read(p, SGE_REG_INTRSTATUS);
+	if (status == 0xffffffff || (status & SGE_INTR_MASK(p)) == 0)
+		return 0;
+
+	//Acknowledge and disable interrupts
+	sge_reg_write(p, SGE_REG_INTRSTATUS, status);
+	sge_reg_write(p, SGE_REG_INTRMASK, 0);
+	sge_reg_write(p, SGE_REG_INTRSTATUS, status);
+
+	return status;
+}
+
+/*===========================================================================*
+ *                            sge_intr_recover                               *
+ *===========================================================================*/
+static void sge_intr_recover(p, status)
+sge_t *p;
+u32_t status;
+{
+	/* Per port: restart halted engines, and follow the link. */
+	if (status & SGE_INTR_RX_HALT)
+		sge_rx_recover(p);
+	if (status & SGE_INTR_TX_HALT)
+	{
+		p->stats.tx_halts++;
+		sge_tx_recover(p);
+	}
+	if (status & SGE_INTR_LINK)
+	{
+		if (p->lag_hash)
+			sge_lag_link(p);
+		else
+			printf("%s: Link changed.\n", p->name);
+	}
+}
+
+/*===========================================================================*
+ *                                sge_tick                                   *
+ *===========================================================================*/
+static void sge_tick(e)
+sge_t *e;
+{
+	clock_t now;
+
+#if SGE_PKTGEN
+	/* A rate limited generator may be waiting for its next slot. */
+	if (e->pg_active)
+		sge_pktgen_run(e);
+#endif
+
+	/* Resume transmission once a PAUSE has run out. */
+	if (e->fc_paused && !sge_tx_paused(e))
+		sge_writev_s(&e->tx_message, TRUE);
+
+	/* Retry a lost XOFF or XON, and refresh XOFF before it expires. */
+	if (e->fc_tx)
+		sge_fc_pressure(e);
+
+	/* Periodic work, driven by our own alarm. */
+	if (!(e->status & SGE_ENABLED))
+	{
+		sge_alarm(e);
+		return;
+	}
+
+	/* The alarm runs faster while a dump is printing; wait our turn. */
+	getuptime(&now);
+	if (e->sample_ticks && now - e->sample_last >= e->sample_ticks)
+		sge_sample(e);
+	if (now - e->poll_last < e->poll_ticks)
+	{
+		sge_alarm(e);
+		return;
+	}
+	e->poll_last = now;
+
+	/* Housekeeping runs whether or not rates are sampled. */
+	sge_tx_watchdog(e);
+	if (e->peer)
+	{
+		sge_tx_watchdog(e->peer);
+
+		/* Link interrupts do the failover; this catches a lost one. */
+		sge_lag_link(e);
+		sge_lag_link(e->peer);
+	}
+
+	/* Finish negotiation late, and start on the waiting backlog. */
+	if (!e->autoneg_done && e->mii != NULL &&
+		(sge_mii_read(e, e->cur_phy, SGE_MIIADDR_STATUS) &
+		SGE_MIISTATUS_AUTO_DONE))
+	{
+		sge_phymode(e);
+		if (e->autoneg_done)
+		{
+			sge_macmode(e);
+			sge_ckpt_save(e);
+			sge_writev_s(&e->tx_message, TRUE);
+		}
+	}
+
+	sge_alarm(e);
+}
+
+/*===========================================================================*
+ *                                sge_alarm                                  *
+ *===========================================================================*/
+static void sge_alarm(e)
+sge_t *e;
+{
+	clock_t now, ticks;
+	int r;
+
+	/*
+	 * Tick every clock while a dump is printing, so it never stalls,
+	 * while the generator runs, so a rate limited one is refilled, while
+	 * paused, so we resume in time, and while our XOFF is out, so it is
+	 * refreshed in time.
+	 */
+	if (e->dump_step != SGE_DUMP_IDLE || SGE_PG_ACTIVE(e) ||
+		e->fc_paused || e->fc_xoff)
+		ticks = 1;
+	else if (e->status & SGE_ENABLED)
+	{
+		/* Whichever of the sampler and the poll is due first. */
+		getuptime(&now);
+		ticks = e->poll_ticks - (now - e->poll_last);
+		if (e->sample_ticks &&
+			e->sample_ticks - (now - e->sample_last) < ticks)
+		{
+			ticks = e->sample_ticks - (now - e->sample_last);
+		}
+		if (ticks <= 0)
+			ticks = 1;
+	}
+	else
+		return;
+
+	/* A lost alarm stops the clock-driven work, not frame I/O. */
+	if ((r = sys_setalarm(ticks, 0)) != OK)
+		printf("%s: sys_setalarm failed: %d\n", e->name, r);
+}
+
+/*===========================================================================*
+ *                               sge_sample                                  *
+ *===========================================================================*/
+static void sge_sample(e)
+sge_t *e;
+{
+	uint64_t cur[SGE_RATE_NR];
+	int64_t rate, avg;
+	clock_t now, elapsed;
+	int i;
+
+	getuptime(&now);
+	elapsed = now - e->sample_last;
+	if (elapsed <= 0)
+		return;
+	e->sample_last = now;
+
+	cur[SGE_RATE_RX_PPS]  = e->stats.rx_packets;
+	cur[SGE_RATE_RX_BPS]  = e->stats.rx_bytes * 8;
+	cur[SGE_RATE_RX_INTR] = e->stats.rx_intrs;
+	cur[SGE_RATE_RX_COPY] = e->stats.rx_copy_bytes;
+	cur[SGE_RATE_TX_PPS]  = e->stats.tx_packets;
+	cur[SGE_RATE_TX_BPS]  = e->stats.tx_bytes * 8;
+	cur[SGE_RATE_TX_INTR] = e->stats.tx_intrs;
+	cur[SGE_RATE_TX_COPY] = e->stats.tx_copy_bytes;
+
+	/* Exponentially weighted per-second rates, in fixed point. */
+	for (i = 0; i < SGE_RATE_NR; i++)
+	{
+		rate = (int64_t)(((cur[i] - e->rate_prev[i]) * sys_hz()
+			<< SGE_RATE_SHIFT) / elapsed);
+		avg = (int64_t)e->rate_avg[i];
+		avg += (rate - avg) / (1 << SGE_RATE_WEIGHT);
+		e->rate_avg[i] = (uint64_t)avg;
+		e->rate_prev[i] = cur[i];
+	}
+#if SGE_RX_DWELL
+	if (e->dwell_on)
+		sge_rx_dwell(e);
+#endif
+	sge_statpage_update(e);
+}
+
+/*===========================================================================*
+ *                           sge_statpage_init                               *
+ *===========================================================================*/
+static void sge_statpage_init(e)
+sge_t *e;
+{
+	char key[DS_MAX_KEYLEN];
+	int r;
+
+	if (e->statpage)
+		return;
+
+	/* Page sized and aligned, so that nothing else is exposed. */
+	if ((e->statpage = alloc_contig(sizeof(sge_statpage_t), AC_ALIGN4K,
+		NULL)) == NULL)
 	{
-		/* Copy read message. */
-		e->rx_message = *mp;
-		e->client = mp->m_source;
-		e->status |= SGE_READING;
-		e->rx_size = 0;
+		printf("%s: failed to allocate statistics page\n", e->name);
+		return;
 	}
+	memset(e->statpage, 0, sizeof(sge_statpage_t));
+	e->statpage->magic = SGE_STATPAGE_MAGIC;
+	e->statpage->hz = sys_hz();
 
-	if (e->status & SGE_READING)
+	e->statpage_grant = cpf_grant_direct(ANY, (vir_bytes) e->statpage,
+		sizeof(sge_statpage_t), CPF_READ);
+	if (!GRANT_VALID(e->statpage_grant))
 	{
-		/*
-		 * Copy the I/O vector table.
-		 */
-		if ((r = sys_safecopyfrom(e->rx_message.m_source,
-			e->rx_message.m_net_netdrv_dl_readv_s.grant, 0,
-			(vir_bytes) iovec,
-			e->rx_message.m_net_netdrv_dl_readv_s.count *
-			sizeof(iovec_s_t))) != OK)
-		{
-			panic("sys_safecopyfrom() failed: %d", r);
-		}
-
-		/* Select packet not owned by the card. */
-		current = e->cur_rx % SGE_RXDESC_NR;
-		desc = &e->rx_desc[current];
+		printf("%s: failed to grant statistics page\n", e->name);
+		return;
+	}
 
-		/* Give up if none found. */
-		if (desc->status & SGE_RXSTATUS_RXOWN)
-		{
-			return;
-		}
+	snprintf(key, sizeof(key), SGE_STATPAGE_KEY, sge_instance);
+	if ((r = ds_publish_u32(key, e->statpage_grant, DSF_OVERWRITE)) != OK)
+		printf("%s: failed to publish %s: %d\n", e->name, key, r);
 
-		pkt_size = (desc->pkt_size & 0xffff);
+	sge_statpage_update(e);
+}
 
-		/* Copy to vector elements. */
-		for (i = 0; i < e->rx_message.m_net_netdrv_dl_readv_s.count &&
-			bytes < pkt_size; i++)
-		{
-			size = iovec[i].iov_size < (pkt_size - bytes) ?
-				iovec[i].iov_size : (pkt_size - bytes);
+/*===========================================================================*
+ *                          sge_statpage_update                              *
+ *===========================================================================*/
+static void sge_statpage_update(e)
+sge_t *e;
+{
+	sge_statpage_t *sp = e->statpage;
+	clock_t now;
 
-			if ((r = sys_safecopyto(e->rx_message.m_source, iovec[i].iov_grant,
-				0, (vir_bytes) e->rx_buffer + bytes +
-				(current * SGE_BUF_SIZE), size)) != OK)
-			{
-				panic("sys_safecopyto() failed: %d", r);
-			}
-			bytes += size;
-		}
+	if (sp == NULL)
+		return;
 
-		/* Flip ownership back to the card */
-		desc->pkt_size = 0;
-		desc->status = SGE_RXSTATUS_RXOWN | SGE_RXSTATUS_RXINT;
+	/* Readers discard snapshots taken while the sequence numbers differ. */
+	sp->seq_tail++;
+	__insn_barrier();
 
-		/* Update current and reenable. */
-		e->cur_rx = (current + 1) % SGE_RXDESC_NR;
-		command = sge_reg_read(e, SGE_REG_RX_CTL);
-		sge_reg_write(e, SGE_REG_RX_CTL, 0x10 | command);
+	getuptime(&now);
+	sp->updated = (uint32_t) now;
+	sp->stats = e->stats;
+	memcpy(sp->rates, e->rate_avg, sizeof(sp->rates));
+	memcpy(sp->rx_dwell, e->dwell_pct, sizeof(sp->rx_dwell));
 
-		e->rx_size = bytes;
-		e->status |= SGE_RECEIVED;
-	}
-	reply(e);
+	__insn_barrier();
+	sp->seq_head = sp->seq_tail;
 }
 
+#if SGE_CAPTURE
 /*===========================================================================*
- *                             sge_getstat_s                                 *
+ *                           sge_capture_init                                *
  *===========================================================================*/
-static void sge_getstat_s(mp)
-message *mp;
+static void sge_capture_init(e)
+sge_t *e;
 {
+	sge_capring_t *cr;
+	char key[DS_MAX_KEYLEN];
+	long rate, snaplen, slots;
+	clock_t uptime;
+	time_t boottime;
 	int r;
-	eth_stat_t stats;
 
-	stats.ets_recvErr   = 0;
-	stats.ets_sendErr   = 0;
-	stats.ets_OVW       = 0;
-	stats.ets_CRCerr    = 0;
-	stats.ets_frameAll  = 0;
-	stats.ets_missedP   = 0;
-	stats.ets_packetR   = 0;
-	stats.ets_packetT   = 0;
-	stats.ets_collision = 0;
-	stats.ets_transAb   = 0;
-	stats.ets_carrSense = 0;
-	stats.ets_fifoUnder = 0;
-	stats.ets_fifoOver  = 0;
-	stats.ets_CDheartbeat = 0;
-	stats.ets_OWC = 0;
+	if (e->cap_ring)
+		return;
 
-	sys_safecopyto(mp->m_source, mp->m_net_netdrv_dl_getstat_s.grant, 0,
-		(vir_bytes)&stats, sizeof(stats));
-	mp->m_type  = DL_STAT_REPLY;
-	if((r=ipc_send(mp->m_source, mp)) != OK)
-		panic("sge_getstat: ipc_send() failed: %d", r);
+	/* Capture one in 'capture' frames; off by default. */
+	if ((rate = sge_env("capture", 0, 0, 1000000)) == 0)
+		return;
+	snaplen = sge_env("snaplen", SGE_CAPTURE_SNAPLEN, ETH_HDR_SIZE,
+		ETH_MAX_PACK_SIZE);
+	slots = sge_env("capture_slots", SGE_CAPTURE_SLOTS, 1, 4096);
+
+	e->cap_size = sizeof(sge_capring_t) +
+		slots * (sizeof(sge_pcap_rec_t) + ((snaplen + 3) & ~3));
+	if ((cr = alloc_contig(e->cap_size, AC_ALIGN4K, NULL)) == NULL)
+	{
+		printf("%s: failed to allocate capture ring\n", e->name);
+		return;
+	}
+	memset(cr, 0, e->cap_size);
+	cr->slots = slots;
+	cr->slot_size = sizeof(sge_pcap_rec_t) + ((snaplen + 3) & ~3);
+	cr->rate = rate;
+	cr->pcap.magic = SGE_PCAP_MAGIC;
+	cr->pcap.version_major = 2;
+	cr->pcap.version_minor = 4;
+	cr->pcap.snaplen = snaplen;
+	cr->pcap.linktype = SGE_PCAP_LINKTYPE;
+
+	e->cap_grant = cpf_grant_direct(ANY, (vir_bytes) cr, e->cap_size,
+		CPF_READ);
+	if (!GRANT_VALID(e->cap_grant))
+	{
+		printf("%s: failed to grant capture ring\n", e->name);
+		free_contig(cr, e->cap_size);
+		return;
+	}
+	snprintf(key, sizeof(key), SGE_CAPTURE_KEY, sge_instance);
+	if ((r = ds_publish_u32(key, e->cap_grant, DSF_OVERWRITE)) != OK)
+		printf("%s: failed to publish %s: %d\n", e->name, key, r);
+
+	/* Anchor the cycle counter to wall clock time. */
+	if ((r = getuptime2(&uptime, &boottime)) != OK)
+		panic("getuptime2 failed: %d", r);
+	read_tsc_64(&e->cap_tsc);
+	e->cap_sec = boottime + uptime / sys_hz();
+	e->cap_usec = ((uptime % sys_hz()) * 1000000) / sys_hz();
+
+	e->cap_skip = 0;
+	e->cap_ring = cr;
 }
 
 /*===========================================================================*
- *                             sge_interrupt                                 *
+ *                              sge_capture                                  *
  *===========================================================================*/
-static void sge_interrupt(mp)
-message *mp;
+static void sge_capture(e, buf, len)
+sge_t *e;
+char *buf;
+size_t len;
 {
-	sge_t *e;
-	u32_t status;
+	sge_capring_t *cr = e->cap_ring;
+	sge_pcap_rec_t *rec;
+	uint64_t tsc, hz, usec;
 
-	/*
-	 * Check the card for interrupt reason(s).
-	 */
-	e = &sge_state;
+	/* Sample one in 'rate' frames. */
+	if (++e->cap_skip < cr->rate)
+		return;
+	e->cap_skip = 0;
+
+	rec = (sge_pcap_rec_t *)((char *)(cr + 1) +
+		(cr->head % cr->slots) * cr->slot_size);
+
+	/* Readers skip the slot until seq is set again. */
+	rec->seq = 0;
+	__insn_barrier();
+
+	/* Wall clock time, from the cycle counter since capture_init. */
+	read_tsc_64(&tsc);
+	hz = (uint64_t) tsc_get_khz() * 1000;
+	tsc -= e->cap_tsc;
+	usec = e->cap_usec + ((tsc % hz) * 1000) / (hz / 1000);
+	rec->ts_sec = (uint32_t)(e->cap_sec + tsc / hz + usec / 1000000);
+	rec->ts_usec = (uint32_t)(usec % 1000000);
+	rec->len = len;
+	rec->caplen = len < cr->pcap.snaplen ? len : cr->pcap.snaplen;
+	memcpy(rec + 1, buf, rec->caplen);
+
+	__insn_barrier();
+	rec->seq = cr->head + 1;
+	__insn_barrier();
+	cr->head++;
+}
+#endif
 
-	status = sge_reg_read(e, SGE_REG_INTRSTATUS);;
-	if (!(status == 0xffffffff || (status & SGE_INTRS) == 0))
-	{
-		//Acknowledge and disable interrupts
-		sge_reg_write(e, SGE_REG_INTRSTATUS, status);
-		sge_reg_write(e, SGE_REG_INTRMASK, 0);
+/*===========================================================================*
+ *                                sge_env                                    *
+ *===========================================================================*/
+static long sge_env(name, def, min, max)
+char *name;
+long def;
+long min;
+long max;
+{
+	long v = def;
 
-		/* Read the Interrupt Cause Read register. */
-		if ((status & SGE_INTRS) == 0)
-		{
-			/* Nothing */
-			return;
-		}
-		sge_reg_write(e, SGE_REG_INTRSTATUS, status);
-		if (status & (SGE_INTR_TX_DONE | SGE_INTR_TX_IDLE))
-			/* Tx interrupt */
-			sge_writev_s(&e->tx_message, TRUE);
-		if (status & (SGE_INTR_RX_DONE | SGE_INTR_RX_IDLE))
-			/* Rx interrupt */
-			sge_readv_s(&e->rx_message, TRUE);
-		if (status & SGE_INTR_LINK)
-			printf("%s: Link changed.\n", e->name);
-	}
+	/* Numeric driver argument, with default. */
+	(void)env_parse(name, "d", 0, &v, min, max);
 
-	/* Re-enable interrupts. */
-	sge_reg_write(e, SGE_REG_INTRMASK, SGE_INTRS);
-	if (sys_irqenable(&e->irq_hook) != OK)
-	{
-		panic("failed to re-enable IRQ");
-	}
+	return v;
 }
 
 /*===========================================================================*
@@ -893,6 +3534,10 @@ uint32_t reg;
 	/* Read from memory mapped register. */
 	value = *(volatile u32_t *)(e->regs + reg);
 
+#if SGE_MMIO_STATS
+	e->mmio_rd[sge_state.mmio_ctx][(reg >> 2) % SGE_REG_NR]++;
+#endif
+
 	/* Return the result. */    
 	return value;
 }
@@ -907,6 +3552,10 @@ uint32_t value;
 {
 	/* Write to memory mapped register. */
 	*(volatile u32_t *)(e->regs + reg) = value;
+
+#if SGE_MMIO_STATS
+	e->mmio_wr[sge_state.mmio_ctx][(reg >> 2) % SGE_REG_NR]++;
+#endif
 }
 
 /*===========================================================================*
@@ -1123,6 +3772,126 @@ sge_t *e;
 	return 1;
 }
 
+/*===========================================================================*
+ *                            sge_phy_restore                                *
+ *===========================================================================*/
+static int sge_phy_restore(e, addr, id0, id1)
+sge_t *e;
+int addr;
+uint16_t id0;
+uint16_t id1;
+{
+	struct mii_phy *phy;
+
+	/*
+	 * Take a known PHY without scanning or resetting it. Returns FALSE
+	 * if another one answers at that address now.
+	 */
+	if (sge_mii_read(e, addr, SGE_MIIADDR_PHY_ID0) != id0 ||
+		sge_mii_read(e, addr, SGE_MIIADDR_PHY_ID1) != id1)
+	{
+		return FALSE;
+	}
+
+	phy = alloc_contig(sizeof(struct mii_phy), 0, NULL);
+	phy->id0 = id0;
+	phy->id1 = id1;
+	phy->addr = addr;
+	phy->status = sge_mii_read(e, addr, SGE_MIIADDR_STATUS);
+	phy->types = 0x2;
+	phy->next = NULL;
+	e->mii = e->first_mii = phy;
+	e->cur_phy = addr;
+
+	return TRUE;
+}
+
+/*===========================================================================*
+ *                             sge_ckpt_save                                 *
+ *===========================================================================*/
+static void sge_ckpt_save(e)
+sge_t *e;
+{
+	sge_ckpt_t ck;
+	char key[DS_MAX_KEYLEN];
+	int r;
+
+	if (e->mii == NULL)
+		return;
+
+	memset(&ck, 0, sizeof(ck));
+	ck.magic = SGE_CKPT_MAGIC;
+	ck.address = e->address;
+	ck.rgmii = e->RGMII;
+	ck.phy_addr = e->cur_phy;
+	ck.phy_id0 = e->mii->id0;
+	ck.phy_id1 = e->mii->id1;
+	ck.link_speed = e->link_speed;
+	ck.duplex_mode = e->duplex_mode;
+
+	snprintf(key, sizeof(key), SGE_CKPT_KEY, sge_instance);
+	if ((r = ds_publish_mem(key, &ck, sizeof(ck), DSF_OVERWRITE)) != OK)
+		printf("%s: failed to publish %s: %d\n", e->name, key, r);
+}
+
+/*===========================================================================*
+ *                           sge_ckpt_restore                                *
+ *===========================================================================*/
+static int sge_ckpt_restore(e)
+sge_t *e;
+{
+	sge_ckpt_t ck;
+	char key[DS_MAX_KEYLEN];
+	size_t len = sizeof(ck);
+	uint16_t status;
+
+	snprintf(key, sizeof(key), SGE_CKPT_KEY, sge_instance);
+	if (ds_retrieve_mem(key, (char *) &ck, &len) != OK ||
+		len != sizeof(ck) || ck.magic != SGE_CKPT_MAGIC)
+	{
+		return FALSE;
+	}
+
+	/*
+	 * Only if the same PHY still has the link up, in the mode it had;
+	 * anything else goes through discovery and negotiation again. The
+	 * mode is read back from the PHY as it stands, not renegotiated.
+	 */
+	if (!sge_phy_restore(e, ck.phy_addr, ck.phy_id0, ck.phy_id1))
+		return FALSE;
+	e->autoneg_done = 0;
+	status = sge_mii_read(e, e->cur_phy, SGE_MIIADDR_STATUS);
+	status = sge_mii_read(e, e->cur_phy, SGE_MIIADDR_STATUS);
+	if ((status & (SGE_MIISTATUS_LINK | SGE_MIISTATUS_AUTO_DONE)) ==
+		(SGE_MIISTATUS_LINK | SGE_MIISTATUS_AUTO_DONE))
+	{
+		sge_phymode(e);
+	}
+	if (!e->autoneg_done || e->link_speed != ck.link_speed ||
+		e->duplex_mode != ck.duplex_mode)
+	{
+		/* Discovery allocates its own. */
+		free_contig(e->mii, sizeof(struct mii_phy));
+		e->mii = e->first_mii = NULL;
+		e->autoneg_done = 0;
+		return FALSE;
+	}
+
+	e->address = ck.address;
+	e->RGMII = ck.rgmii;
+	sge_macmode(e);
+	if (e->RGMII)
+	{
+		sge_reg_write(e, SGE_REG_RGMIIDELAY, 0x0441);
+		sge_reg_write(e, SGE_REG_RGMIIDELAY, 0x0440);
+	}
+
+	printf("%s: restarted from checkpoint, %d Mbps %s-duplex\n", e->name,
+		e->link_speed, e->duplex_mode ? "full" : "half");
+
+	return TRUE;
+}
+
 /*===========================================================================*
  *                            sge_default_phy                                *
  *===========================================================================*/
@@ -1179,7 +3948,7 @@ sge_t *e;
 uint32_t addr;
 {
 	int i = 0;
-	u16_t status;
+	u16_t status, adv;
 
 	status = sge_mii_read(e, addr, SGE_MIIADDR_STATUS);
 	status = sge_mii_read(e, addr, SGE_MIIADDR_STATUS);
@@ -1187,6 +3956,29 @@ uint32_t addr;
 	sge_mii_write(e, addr, SGE_MIIADDR_CONTROL,
 		(SGE_MIICTRL_RESET | SGE_MIICTRL_AUTO | SGE_MIICTRL_RST_AUTO));
 
+	/* Advertise our pause abilities, and negotiate with them. */
+	if (e->fc_mode != SGE_FC_OFF)
+	{
+		/* The PHY ignores writes until it is out of reset (<= 500ms). */
+		while ((sge_mii_read(e, addr, SGE_MIIADDR_CONTROL) &
+			SGE_MIICTRL_RESET) && i++ < 500)
+		{
+			micro_delay(1000);
+		}
+		if (i > 500)
+			printf("%s: PHY %u still in reset\n", e->name, addr);
+
+		adv = sge_mii_read(e, addr, SGE_MIIADDR_AUTO_ADV);
+		adv &= ~(SGE_MIIAUTON_PAUSE | SGE_MIIAUTON_ASM_DIR);
+		if (e->fc_mode & SGE_FC_SYM)
+			adv |= SGE_MIIAUTON_PAUSE;
+		if (e->fc_mode & SGE_FC_ASYM)
+			adv |= SGE_MIIAUTON_ASM_DIR;
+		sge_mii_write(e, addr, SGE_MIIADDR_AUTO_ADV, adv);
+		sge_mii_write(e, addr, SGE_MIIADDR_CONTROL,
+			(SGE_MIICTRL_AUTO | SGE_MIICTRL_RST_AUTO));
+	}
+
 	return status;
 }
 
@@ -1243,6 +4035,36 @@ sge_t *e;
 	}
 
 	e->autoneg_done = 1;
+	sge_fc_resolve(e);
+}
+
+/*===========================================================================*
+ *                             sge_fc_resolve                                *
+ *===========================================================================*/
+static void sge_fc_resolve(e)
+sge_t *e;
+{
+	u16_t adv, lpar;
+
+	e->fc_tx = e->fc_rx = FALSE;
+	e->fc_xoff = e->fc_paused = FALSE;
+	if (e->fc_mode == SGE_FC_OFF || !e->duplex_mode)
+		return;
+
+	/* Pause resolution, as in IEEE 802.3 Annex 28B. */
+	adv = sge_mii_read(e, e->cur_phy, SGE_MIIADDR_AUTO_ADV);
+	lpar = sge_mii_read(e, e->cur_phy, SGE_MIIADDR_AUTO_LPAR);
+	if ((adv & SGE_MIIAUTON_PAUSE) && (lpar & SGE_MIIAUTON_PAUSE))
+	{
+		e->fc_tx = e->fc_rx = TRUE;
+	}
+	else if ((adv & SGE_MIIAUTON_ASM_DIR) && (lpar & SGE_MIIAUTON_ASM_DIR))
+	{
+		if (lpar & SGE_MIIAUTON_PAUSE)
+			e->fc_tx = TRUE;
+		else if (adv & SGE_MIIAUTON_PAUSE)
+			e->fc_rx = TRUE;
+	}
 }
 
 /*===========================================================================*
@@ -1307,12 +4129,15 @@ sge_t *e;
 	if (e->status & SGE_READING && e->status & SGE_RECEIVED)
 	{
 		msg.m_netdrv_net_dl_task.flags |= DL_PACK_RECV;
-		msg.m_netdrv_net_dl_task.count =
-			e->rx_size >= ETH_MIN_PACK_SIZE ?
-				e->rx_size  : ETH_MIN_PACK_SIZE;
+		msg.m_netdrv_net_dl_task.count = e->rx_size;
+		if (e->rx_csum_ok)
+			msg.m_netdrv_net_dl_task.flags |= SGE_DL_CSUM_OK;
+		if (e->rx_stamp_ok)
+			msg.m_netdrv_net_dl_task.flags |= SGE_DL_RXSTAMP;
 
 		/* Clear flags. */
 		e->status &= ~(SGE_READING | SGE_RECEIVED);
+		e->rx_iovec_valid = FALSE;
 	}
 	/* Did we successfully transmit packet(s)? */
 	if (e->status & SGE_TRANSMIT && e->status & SGE_WRITING)
@@ -1321,6 +4146,8 @@ sge_t *e;
 		
 		/* Clear flags. */
 		e->status &= ~(SGE_WRITING | SGE_TRANSMIT);
+		e->tx_iovec_valid = FALSE;
+		e->tx_staged = 0;
 	}
 
 	/* Acknowledge to INET. */
@@ -1343,6 +4170,25 @@ message *reply_mess;
 	}
 }
 
+/*===========================================================================*
+ *                                sge_fkey                                   *
+ *===========================================================================*/
+static void sge_fkey(m)
+message *m;
+{
+	int fkeys, sfkeys;
+
+	if (fkey_events(&fkeys, &sfkeys) != OK)
+		return;
+
+	if (bit_isset(sfkeys, 7))
+		sge_dump(m);
+#if SGE_PKTGEN
+	if (bit_isset(sfkeys, 8))
+		sge_pktgen_start(&sge_state);
+#endif
+}
+
 /*===========================================================================*
  *                               sge_dump                                    *
  *===========================================================================*/
@@ -1350,94 +4196,317 @@ static void sge_dump(m)
 message *m;
 {
 	sge_t *e;
+	long i;
+
 	e = &sge_state;
+
+	/* A dump is already on its way. */
+	if (e->dump_step != SGE_DUMP_IDLE)
+		return;
+
+	/*
+	 * Snapshot the MAC registers now, which is cheap. Everything slow is
+	 * read a slice at a time by sge_dump_step(), between events.
+	 */
+	for (i = 0; i < SGE_REG_NR; i++)
+		e->dump_regs[i] = sge_reg_read(e, i << 2);
+
+	e->dump_step = SGE_DUMP_HEADER;
+	e->dump_idx = 0;
+	sge_alarm(e);
+}
+
+/*===========================================================================*
+ *                             sge_dump_step                                 *
+ *===========================================================================*/
+static void sge_dump_step(e)
+sge_t *e;
+{
 	long i;
-	char *dname;
+	char *dname = "unknown adapter";
 
-	switch (e->model)
+	switch (e->dump_step)
 	{
-		case SGE_DEV_0190:
-			dname = "SiS 190 PCI Fast Ethernet Adapter";
-			break;
-		case SGE_DEV_0191:
-			dname = "SiS 191 PCI Gigabit Ethernet Adapter";
-			break;
-	}
+	case SGE_DUMP_HEADER:
+		switch (e->model)
+		{
+			case SGE_DEV_0190:
+				dname = "SiS 190 PCI Fast Ethernet Adapter";
+				break;
+			case SGE_DEV_0191:
+				dname = "SiS 191 PCI Gigabit Ethernet Adapter";
+				break;
+		}
+
+		printf("%s is a %s\n", e->name, dname);
+		printf("Build profile %d: rings %u/%u, interrupt timer %d, "
+			"instrumentation%s%s%s%s%s\n", SGE_PROFILE, e->rx_desc_nr,
+			e->tx_desc_nr, SGE_INTR_COAL,
+			SGE_MMIO_STATS ? " mmio" : "", SGE_RX_DWELL ? " dwell" : "",
+			SGE_SELFTEST ? " selftest" : "", SGE_PKTGEN ? " pktgen" : "",
+			SGE_CAPTURE ? " capture" : "");
+		printf("PCI: cache line %d bytes (reads %d), latency %d (reads %d), "
+			"MWI %s; DMA control TX 0x%08x RX 0x%08x\n", e->pci_cls,
+			pci_attr_r8(e->devind, SGE_PCI_CLS) * 4, e->pci_latency,
+			pci_attr_r8(e->devind, SGE_PCI_LAT),
+			(pci_attr_r16(e->devind, PCI_CR) & SGE_PCI_CR_MWI) ?
+			"on" : "off", e->dma_tx_ctl, e->dma_rx_ctl);
+
+		/* MAC Address */
+		printf("Ethernet Address %x:%x:%x:%x:%x:%x\n",
+			e->address.ea_addr[0], e->address.ea_addr[1],
+			e->address.ea_addr[2], e->address.ea_addr[3],
+			e->address.ea_addr[4], e->address.ea_addr[5]);
+
+		/* Link speed */
+		printf("Media Link On %d Mbps %s-duplex \n",
+			e->link_speed,
+			e->duplex_mode ? "full" : "half");
+
+		/* PHY Transceiver */
+		if (e->mii != NULL)
+		{
+			printf("PHY Transceiver (%0x/%0x) found at address %d\n",
+				e->mii->id0, (e->mii->id1 & 0xFFF0), e->mii->addr);
+		}
+		e->dump_step = SGE_DUMP_MAC;
+		break;
 
-	printf("%s is a %s\n", e->name, dname);
+	case SGE_DUMP_MAC:
+		/* Mac Registers (Memory Mapped), as captured on request */
+		printf("MAC Registers:\n");
+		for(i = 0; i < SGE_REG_NR; i++)
+		{
+			if((i%4) == 0)
+				printf("%2.2xh: ", (unsigned int)(i << 2));
 
-	/* MAC Address */
-	printf("Ethernet Address %x:%x:%x:%x:%x:%x\n",
-		e->address.ea_addr[0], e->address.ea_addr[1],
-		e->address.ea_addr[2], e->address.ea_addr[3],
-		e->address.ea_addr[4], e->address.ea_addr[5]);
+			printf("%8.8x ", e->dump_regs[i]);
 
-	/* Link speed */
-	printf("Media Link On %d Mbps %s-duplex \n",
-		e->link_speed,
-		e->duplex_mode ? "full" : "half");
+			if((i%4) == 3)
+				printf("\n");
+		}
+		e->dump_step = SGE_DUMP_EEPROM;
+		break;
 
-	/* PHY Transceiver */       
-	printf("PHY Transceiver (%0x/%0x) found at address %d\n",
-		e->mii->id0, (e->mii->id1 & 0xFFF0), e->mii->addr);
+	case SGE_DUMP_EEPROM:
+		/* The EEPROM is slow; fill the cache a few words at a time. */
+		if (e->eeprom_nr < SGE_DUMP_EEPROM_NR)
+		{
+			for (i = 0; i < SGE_DUMP_EEPROM_STEP &&
+				e->eeprom_nr < SGE_DUMP_EEPROM_NR; i++)
+			{
+				e->eeprom[e->eeprom_nr] = read_eeprom(e, e->eeprom_nr);
+				e->eeprom_nr++;
+			}
+			break;
+		}
 
-	/* Mac Registers (Memory Mapped)*/
-	printf("MAC Registers:\n");
-	for(i = 0; i < 0x80; i+=4)
-	{
-		if((i%16) == 0)
-			printf("%2.2xh: ", (char)i);
+		printf("EEPROM Dump:\n");
+		for(i = 0; i < SGE_DUMP_EEPROM_NR; i+=1)
+		{
+			if(i%0x8 == 0)
+				printf("%2.2xh: ", (unsigned int)i);
 
-		printf("%8.8x ", sge_reg_read(e, i));
+			printf("%4.4x ", e->eeprom[i]);
 
-		if((i%16) == 12)
-			printf("\n");
-	}
+			if(i == 0x7)
+				printf("\n");
+		}
+		printf("\n");
+		e->dump_step = SGE_DUMP_PHY;
+		break;
 
-	/* EEPROM */
-	printf("EEPROM Dump:\n");
-	for(i = 0; i < 0x10; i+=1)
-	{
-		if(i%0x8 == 0)
-			printf("%2.2xh: ", (char)i);
+	case SGE_DUMP_PHY:
+		/* Likewise for the PHY, which is read through the MII. */
+		if (e->dump_idx < SGE_DUMP_PHY_NR)
+		{
+			for (i = 0; i < SGE_DUMP_PHY_STEP &&
+				e->dump_idx < SGE_DUMP_PHY_NR; i++)
+			{
+				e->dump_phy[e->dump_idx] = sge_mii_read(e, e->cur_phy,
+					e->dump_idx);
+				e->dump_idx++;
+			}
+			break;
+		}
 
-		printf("%4.4x ", read_eeprom(e, i));
+		printf("PHY Registers:\n");
+		for(i = 0; i < SGE_DUMP_PHY_NR; i+=1)
+		{
+			if((i%8) == 0 )
+				printf("%2.2xh: ", (unsigned int)i);
 
-		if(i == 0x7)
-			printf("\n");
-	}
-	printf("\n");
+			printf("%4.4x ", e->dump_phy[i]);
 
-	/* EEPROM */
-	printf("PHY Registers:\n");
-	for(i = 0; i < 0x20; i+=1)
-	{
-		if((i%8) == 0 )
-			printf("%2.2xh: ", (char)i);
+			if((i%8)==7)
+				printf("\n");
+		}
+		printf("\n");
+		e->dump_step = SGE_DUMP_RINGS;
+		break;
 
-		printf("%4.4x ", sge_mii_read(e, e->cur_phy, i));
+	case SGE_DUMP_RINGS:
+		printf("Current descriptors: TX: %d, RX: %d\n", e->cur_tx, e->cur_rx);
+		printf("Current descriptor data: TX: %8.8x %8.8x %8.8x %8.8x\n",
+			e->tx_desc[e->cur_tx].pkt_size,	e->tx_desc[e->cur_tx].status,
+			e->tx_desc[e->cur_tx].buf_ptr, e->tx_desc[e->cur_tx].flags);
+		printf("Current descriptor data: RX: %8.8x %8.8x %8.8x %8.8x\n",
+			e->rx_desc[e->cur_rx].pkt_size, e->rx_desc[e->cur_rx].status,
+			e->rx_desc[e->cur_rx].buf_ptr, e->rx_desc[e->cur_rx].flags);
+		if (e->cur_tx != 0)
+		{
+			printf("Last descriptor data: TX: %8.8x %8.8x %8.8x %8.8x\n",
+				e->tx_desc[(e->cur_tx) - 1].pkt_size, e->tx_desc[(e->cur_tx) - 1].status,
+				e->tx_desc[(e->cur_tx) - 1].buf_ptr, e->tx_desc[(e->cur_tx) - 1].flags);
+		}
+		if (e->cur_rx)
+		{
+			printf("Last descriptor data: RX: %8.8x %8.8x %8.8x %8.8x\n",
+				e->rx_desc[(e->cur_rx) - 1].pkt_size, e->rx_desc[(e->cur_rx) - 1].status,
+				e->rx_desc[(e->cur_rx) - 1].buf_ptr, e->rx_desc[(e->cur_rx) - 1].flags);
+		}
+		printf("RX queue: %u/%u staged, max %u, %llu total, %llu full\n",
+			e->rxq_tail - e->rxq_head, e->rxq_depth, e->rxq_max,
+			e->stats.rx_staged, e->stats.rxq_full);
+		printf("TX backlog: %u/%u queued, max %u, %llu total, %llu held; "
+			"ring %u in use\n",
+			e->txq_tail - e->txq_head, e->txq_depth, e->txq_max,
+			e->stats.tx_backlogged, e->stats.tx_held, e->tx_inuse);
+		printf("Interrupts: %s\n", e->pipeline ?
+			"pipelined, rings serviced before client copies" :
+			"single stage");
+		if (e->peer)
+		{
+			printf("Aggregate, L%d hash: %s link %s, %u in ring, %llu sent; "
+				"%s link %s, %u in ring, %llu sent\n", e->lag_hash,
+				e->name, e->link_up ? "up" : "down", e->tx_inuse,
+				e->stats.tx_packets, e->peer->name,
+				e->peer->link_up ? "up" : "down", e->peer->tx_inuse,
+				e->peer->stats.tx_packets);
+		}
+		if (e->prio_on)
+		{
+			printf("TX priority lane: type %04x dscp %u size %u, "
+				"%u reserved; %u queued, %llu sent, %llu done, "
+				"%llu backlogged\n", e->prio_type, e->prio_dscp,
+				e->prio_size, e->prio_reserve,
+				e->prioq_tail - e->prioq_head, e->stats.tx_prio_packets,
+				e->stats.tx_prio_done, e->stats.tx_prio_backlogged);
+		}
+		e->dump_step = SGE_DUMP_COUNTERS;
+		break;
+
+	case SGE_DUMP_COUNTERS:
+		printf("RX: %llu pkts %llu pps %llu bps %llu intr/s %llu copy B/s\n",
+			e->stats.rx_packets,
+			e->rate_avg[SGE_RATE_RX_PPS] >> SGE_RATE_SHIFT,
+			e->rate_avg[SGE_RATE_RX_BPS] >> SGE_RATE_SHIFT,
+			e->rate_avg[SGE_RATE_RX_INTR] >> SGE_RATE_SHIFT,
+			e->rate_avg[SGE_RATE_RX_COPY] >> SGE_RATE_SHIFT);
+		printf("RX errors: %llu (crc %llu abort %llu overrun %llu short %llu "
+			"limit %llu miier %llu frame %llu)\n",
+			e->stats.rx_errors, e->stats.rx_crc, e->stats.rx_abort,
+			e->stats.rx_overrun, e->stats.rx_short, e->stats.rx_limit,
+			e->stats.rx_miier, e->stats.rx_frame);
+#if SGE_RX_DWELL
+		if (e->dwell_on)
+		{
+			sge_rx_dwell(e);
+			printf("RX dwell over %u frames: p50 %llu ns, p90 %llu ns, "
+				"p99 %llu ns, max %llu ns\n",
+				e->dwell_idx < SGE_DWELL_NR ? e->dwell_idx : SGE_DWELL_NR,
+				e->dwell_pct[SGE_PCT_50], e->dwell_pct[SGE_PCT_90],
+				e->dwell_pct[SGE_PCT_99], e->dwell_pct[SGE_PCT_MAX]);
+			if (e->caps & SGE_CAP_RXSTAMP)
+				printf("RX stamps: %llu frames without room for one\n",
+					e->stats.rx_stamp_short);
+		}
+#endif
+		printf("VLAN: native %d, filter %s, %llu dropped\n", e->vlan_pvid,
+			e->vlan_filter ? "on" : "off", e->stats.rx_vlan_drop);
+		printf("RX checksums: %llu verified, %llu IP bad, %llu TCP/UDP bad\n",
+			e->stats.rx_csum_ok, e->stats.rx_ipcsum_bad,
+			e->stats.rx_l4csum_bad);
+		printf("TX: %llu pkts %llu pps %llu bps %llu intr/s %llu copy B/s\n",
+			e->stats.tx_packets,
+			e->rate_avg[SGE_RATE_TX_PPS] >> SGE_RATE_SHIFT,
+			e->rate_avg[SGE_RATE_TX_BPS] >> SGE_RATE_SHIFT,
+			e->rate_avg[SGE_RATE_TX_INTR] >> SGE_RATE_SHIFT,
+			e->rate_avg[SGE_RATE_TX_COPY] >> SGE_RATE_SHIFT);
+		printf("Flow control: %s, send %s, honour %s; PAUSE sent %llu, "
+			"received %llu%s\n", e->fc_mode ? "advertised" : "off",
+			e->fc_tx ? "yes" : "no", e->fc_rx ? "yes" : "no",
+			e->stats.tx_pause, e->stats.rx_pause,
+			e->fc_paused ? ", paused now" : "");
+		printf("Recovery: RX halts %llu, TX halts %llu, TX timeouts %llu, "
+			"TX lost %llu, RX lost to update %llu\n", e->stats.rx_halts,
+			e->stats.tx_halts, e->stats.tx_timeouts, e->stats.tx_lost,
+			e->stats.rx_lu_drop);
+#if SGE_PKTGEN
+		printf("Pktgen: %s, %u of %u frames of %u bytes, last run %llu pps "
+			"%llu bps\n", e->pg_active ? "running" : "idle", e->pg_posted,
+			e->pg_target, e->pg_size, e->pg_pps, e->pg_bps);
+#endif
+		e->dump_step = SGE_DUMP_MMIO;
+		break;
 
-		if((i%8)==7)
-			printf("\n");
+	case SGE_DUMP_MMIO:
+#if SGE_MMIO_STATS
+		sge_mmio_dump(e);
+#endif
+		/* fall through */
+	default:
+		e->dump_step = SGE_DUMP_IDLE;
+		break;
 	}
-	printf("\n");
-	printf("Current descriptors: TX: %d, RX: %d\n", e->cur_tx, e->cur_rx);
-	printf("Current descriptor data: TX: %8.8x %8.8x %8.8x %8.8x\n",
-		e->tx_desc[e->cur_tx].pkt_size,	e->tx_desc[e->cur_tx].status,
-		e->tx_desc[e->cur_tx].buf_ptr, e->tx_desc[e->cur_tx].flags);
-	printf("Current descriptor data: RX: %8.8x %8.8x %8.8x %8.8x\n",
-		e->rx_desc[e->cur_rx].pkt_size, e->rx_desc[e->cur_rx].status,
-		e->rx_desc[e->cur_rx].buf_ptr, e->rx_desc[e->cur_rx].flags);
-	if (e->cur_tx != 0)
+}
+
+#if SGE_MMIO_STATS
+/*===========================================================================*
+ *                             sge_mmio_dump                                 *
+ *===========================================================================*/
+static void sge_mmio_dump(e)
+sge_t *e;
+{
+	static const char *ctx_name[SGE_CTX_NR] = { "mgmt", "intr", "tx", "rx" };
+	uint32_t total[SGE_CTX_NR];
+	uint32_t packets;
+	int c, i;
+
+	/* Accesses per register, split by caller context. */
+	printf("MMIO accesses (reads/writes):\n");
+	printf("reg  %-17s %-17s %-17s %-17s\n",
+		ctx_name[0], ctx_name[1], ctx_name[2], ctx_name[3]);
+	memset(total, 0, sizeof(total));
+	for (i = 0; i < SGE_REG_NR; i++)
 	{
-		printf("Last descriptor data: TX: %8.8x %8.8x %8.8x %8.8x\n",
-			e->tx_desc[(e->cur_tx) - 1].pkt_size, e->tx_desc[(e->cur_tx) - 1].status,
-			e->tx_desc[(e->cur_tx) - 1].buf_ptr, e->tx_desc[(e->cur_tx) - 1].flags);
+		for (c = 0; c < SGE_CTX_NR; c++)
+		{
+			if (e->mmio_rd[c][i] || e->mmio_wr[c][i])
+				break;
+		}
+		if (c == SGE_CTX_NR)
+			continue;
+
+		printf("%2.2xh:", i << 2);
+		for (c = 0; c < SGE_CTX_NR; c++)
+		{
+			printf(" %8u/%-8u", e->mmio_rd[c][i], e->mmio_wr[c][i]);
+			total[c] += e->mmio_rd[c][i] + e->mmio_wr[c][i];
+		}
+		printf("\n");
 	}
-	if (e->cur_rx)
+
+	/* Accesses per packet, in hundredths. */
+	packets = (uint32_t)(e->stats.rx_packets + e->stats.tx_packets);
+	if (packets == 0)
+		return;
+	printf("MMIO per packet (%u packets):", packets);
+	for (c = 0; c < SGE_CTX_NR; c++)
 	{
-		printf("Last descriptor data: RX: %8.8x %8.8x %8.8x %8.8x\n",
-			e->rx_desc[(e->cur_rx) - 1].pkt_size, e->rx_desc[(e->cur_rx) - 1].status,
-			e->rx_desc[(e->cur_rx) - 1].buf_ptr, e->rx_desc[(e->cur_rx) - 1].flags);
+		printf(" %s %u.%02u", ctx_name[c], total[c] / packets,
+			(uint32_t)(((uint64_t)(total[c] % packets) * 100) / packets));
 	}
+	printf("\n");
 }
+#endif
@@ -19,10 +19,82 @@
 /* MAC Override */
 #define SGE_ENVVAR		"SGEETH"
 
+/* Build profiles, chosen with SGE_PROFILE in the Makefile */
+#define SGE_PROFILE_DEFAULT	0
+#define SGE_PROFILE_LATENCY	1 /* Small rings, no coalescing, direct replies */
+#define SGE_PROFILE_THROUGHPUT	2 /* Deep rings, coalescing, no instrumentation */
+#define SGE_PROFILE_DEBUG	3 /* All instrumentation */
+#ifndef SGE_PROFILE
+#define SGE_PROFILE		SGE_PROFILE_DEFAULT
+#endif
+
+#if SGE_PROFILE == SGE_PROFILE_LATENCY
+#define SGE_PROF_RING		16
+#define SGE_PROF_QUEUE		16
+#define SGE_PROF_COAL		0
+#define SGE_PROF_PIPELINE	0
+#define SGE_PROF_MEASURE	1
+#define SGE_PROF_TOOLS		0
+#define SGE_PROF_MMIO		0
+#elif SGE_PROFILE == SGE_PROFILE_THROUGHPUT
+#define SGE_PROF_RING		256
+#define SGE_PROF_QUEUE		256
+#define SGE_PROF_COAL		0x40
+#define SGE_PROF_PIPELINE	1
+#define SGE_PROF_MEASURE	0
+#define SGE_PROF_TOOLS		0
+#define SGE_PROF_MMIO		0
+#elif SGE_PROFILE == SGE_PROFILE_DEBUG
+#define SGE_PROF_RING		32
+#define SGE_PROF_QUEUE		64
+#define SGE_PROF_COAL		0
+#define SGE_PROF_PIPELINE	1
+#define SGE_PROF_MEASURE	1
+#define SGE_PROF_TOOLS		1
+#define SGE_PROF_MMIO		1
+#else
+#define SGE_PROF_RING		32
+#define SGE_PROF_QUEUE		64
+#define SGE_PROF_COAL		0
+#define SGE_PROF_PIPELINE	0
+#define SGE_PROF_MEASURE	1
+#define SGE_PROF_TOOLS		1
+#define SGE_PROF_MMIO		0
+#endif
+
+/* Features left out of a profile are compiled out; each can be set alone. */
+#ifndef SGE_MMIO_STATS
+#define SGE_MMIO_STATS		SGE_PROF_MMIO /* Count MMIO accesses per register */
+#endif
+#ifndef SGE_RX_DWELL
+#define SGE_RX_DWELL		SGE_PROF_MEASURE /* RX dwell time, client stamps */
+#endif
+#ifndef SGE_SELFTEST
+#define SGE_SELFTEST		SGE_PROF_MEASURE /* PHY loopback self-test */
+#endif
+#ifndef SGE_PKTGEN
+#define SGE_PKTGEN		SGE_PROF_TOOLS /* Packet generator on Shift+F8 */
+#endif
+#ifndef SGE_CAPTURE
+#define SGE_CAPTURE		SGE_PROF_TOOLS /* Sampled capture ring */
+#endif
+#ifndef SGE_INTR_COAL
+#define SGE_INTR_COAL		SGE_PROF_COAL /* Interrupt timer, 0 for none */
+#endif
+#ifndef SGE_PIPELINE
+#define SGE_PIPELINE		SGE_PROF_PIPELINE /* Default of "pipeline" */
+#endif
+
 /* Device IDs */
 #define SGE_DEV_0190	0x0190 /* SiS190 */
 #define SGE_DEV_0191	0x0191 /* SiS191 */
 
+/* PCI bus tuning, beyond <machine/pci.h> */
+#define SGE_PCI_CLS		0x0C /* Cache Line Size, in dwords */
+#define SGE_PCI_LAT		0x0D /* Latency Timer, in PCI clocks */
+#define SGE_PCI_CR_MWI		0x0010 /* Memory Write and Invalidate */
+#define SGE_DMA_CTL_MASK	(~0x11) /* DMA control word, less enable/poll */
+
 /* Ethernet driver statuses */
 #define SGE_DETECTED		(1 << 0)
 #define SGE_ENABLED		(1 << 1)
@@ -45,14 +117,66 @@
 
 /* Buffer info */
 #define SGE_IOVEC_NR		16
-#define SGE_BUF_SIZE		2048
-#define SGE_RXDESC_NR		32
-#define SGE_TXDESC_NR		32
-#define SGE_RXB_TOTALSIZE		SGE_RXDESC_NR*SGE_BUF_SIZE
-#define SGE_TXB_TOTALSIZE		SGE_TXDESC_NR*SGE_BUF_SIZE
-#define SGE_RXD_TOTALSIZE		SGE_RXDESC_NR*sizeof(sge_desc_t)
-#define SGE_TXD_TOTALSIZE		SGE_TXDESC_NR*sizeof(sge_desc_t)
+#define SGE_CACHELINE		64
+#define SGE_BUF_SIZE		1536 /* Tagged frame with FCS, cache aligned */
+#define SGE_RXDESC_NR		SGE_PROF_RING /* Default ring sizes */
+#define SGE_TXDESC_NR		SGE_PROF_RING
+#define SGE_DESC_MAX		1024
+#define SGE_ALIGN(x, a)		(((x) + (a) - 1) & ~((a) - 1))
 #define SGE_DESC_FINAL		0x80000000
+#define SGE_RXQ_NR		SGE_PROF_QUEUE /* Default software RX queue depth */
+#define SGE_TXQ_NR		SGE_PROF_QUEUE /* Default software TX backlog depth */
+#define SGE_TX_TIMEOUT		2 /* Polls (SGE_POLL_MS) without TX progress */
+#define SGE_PRIOQ_NR		16 /* Priority frames waiting for the ring */
+#define SGE_PRIO_RESERVE		4 /* Descriptors bulk traffic may not use */
+
+/* Origin of a frame posted to the TX ring, for accounting */
+#define SGE_TXO_CLIENT		0 /* Bulk client frame */
+#define SGE_TXO_PRIO		1 /* Client frame on the priority lane */
+#define SGE_TXO_PKTGEN		2 /* Generated, counted in pg_* only */
+#define SGE_TXO_CTRL		3 /* MAC control, untagged, in tx_pause */
+
+/* Diagnostic dump, printed in slices between events */
+#define SGE_DUMP_IDLE		0
+#define SGE_DUMP_HEADER		1
+#define SGE_DUMP_MAC		2
+#define SGE_DUMP_EEPROM		3
+#define SGE_DUMP_PHY		4
+#define SGE_DUMP_RINGS		5
+#define SGE_DUMP_COUNTERS		6
+#define SGE_DUMP_MMIO		7
+#define SGE_DUMP_EEPROM_NR		16
+#define SGE_DUMP_EEPROM_STEP		2 /* EEPROM words read per slice */
+#define SGE_DUMP_PHY_NR		32
+#define SGE_DUMP_PHY_STEP		4 /* PHY registers read per slice */
+
+/* Built-in packet generator */
+#define SGE_PKTGEN_COUNT		100000
+#define SGE_PKTGEN_TYPE		0x88B5 /* IEEE local experimental */
+
+/* Loopback self-test */
+#define SGE_SELFTEST_MAGIC		0x53474554 /* "SGET" */
+#define SGE_SELFTEST_WAIT_US		10000 /* Per frame, before it is lost */
+#define SGE_SELFTEST_AUTONEG_MS		3000
+#define SGE_SELFTEST_MAX		1000 /* Frames; init blocks while it runs */
+
+/* RX dwell time: frames sampled between first sight and delivery */
+#define SGE_DWELL_NR		1024
+
+/* Percentiles, as filled in by sge_percentiles() */
+#define SGE_PCT_50		0
+#define SGE_PCT_90		1
+#define SGE_PCT_99		2
+#define SGE_PCT_MAX		3
+#define SGE_PCT_NR		4
+
+/* MMIO accounting: caller contexts and register slots */
+#define SGE_CTX_MGMT		0 /* Init, configuration, dumps */
+#define SGE_CTX_INTR		1 /* Interrupt handling */
+#define SGE_CTX_TX		2 /* DL_WRITEV_S requests */
+#define SGE_CTX_RX		3 /* DL_READV_S requests */
+#define SGE_CTX_NR		4
+#define SGE_REG_NR		(0x80 / 4)
 
 /* Register Addresses */
 #define	SGE_REG_TX_CTL			0x00 /* Tx Host Control/status Register */
@@ -99,15 +223,25 @@
 #define	SGE_REGSC_SPEED_1000		0x00000c00
 
 /* RX mode */
+#define SGE_RXCTRL_CSUM		0x0002 /* Verify IP/TCP/UDP checksums */
+#define SGE_RXCTRL_PAD		0x0004
+#define SGE_RXCTRL_STRIP_FCS		0x0010
+#define SGE_RXCTRL_STRIP_VLAN		0x0020
 #define SGE_RXCTRL_BCAST		0x0800
 #define	SGE_RXCTRL_MCAST		0x0400
 #define	SGE_RXCTRL_MYPHYS		0x0200
 #define	SGE_RXCTRL_ALLPHYS		0x0100
 
+/* TX descriptor size word */
+#define SGE_TXINFO_INSVLAN		0x80000000 /* Insert tag from status */
+
 /* TX descriptor command/status */
 #define SGE_TXSTATUS_TXOWN		0x80000000
 #define SGE_TXSTATUS_TXINT		0x40000000
 #define SGE_TXSTATUS_THOL3		0x30000000
+#define SGE_TXSTATUS_IPCS		0x04000000
+#define SGE_TXSTATUS_TCPCS		0x02000000
+#define SGE_TXSTATUS_UDPCS		0x01000000
 #define SGE_TXSTATUS_BSTEN		0x00800000
 #define SGE_TXSTATUS_EXTEN		0x00400000
 #define SGE_TXSTATUS_DEFEN		0x00200000
@@ -117,7 +251,16 @@
 #define SGE_TXSTATUS_CRCEN		0x00020000
 #define SGE_TXSTATUS_PADEN		0x00010000
 
-/* RX descriptor status */
+/* RX descriptor size word */
+#define SGE_RXINFO_TAGON		0x80000000 /* Tag stripped, in status */
+#define SGE_RXINFO_SIZE		0x0000ffff
+
+/* VLAN tag, in the low bits of the descriptor status */
+#define SGE_DESC_VLAN_MASK		0x0000ffff
+#define SGE_VLAN_ID_MASK		0x0fff
+#define SGE_VLAN_NR		16 /* Configured VLANs per instance */
+
+/* RX descriptor status (CRCOK to ABORT are reported in pkt_size) */
 #define SGE_RXSTATUS_CRCOK		0x00010000
 #define SGE_RXSTATUS_COLON		0x00020000
 #define SGE_RXSTATUS_NIBON		0x00040000
@@ -126,8 +269,37 @@
 #define SGE_RXSTATUS_LIMIT		0x00200000
 #define SGE_RXSTATUS_SHORT		0x00400000
 #define SGE_RXSTATUS_ABORT		0x00800000
+#define SGE_RXSTATUS_UDPOK		0x01000000 /* In status */
+#define SGE_RXSTATUS_TCPOK		0x02000000
+#define SGE_RXSTATUS_IPOK		0x04000000
+#define SGE_RXSTATUS_UDPON		0x08000000
+#define SGE_RXSTATUS_TCPON		0x10000000
+#define SGE_RXSTATUS_IPON		0x20000000
 #define SGE_RXSTATUS_RXINT		0x40000000
 #define SGE_RXSTATUS_RXOWN		0x80000000
+#define SGE_RXSTATUS_ERRORS \
+	(SGE_RXSTATUS_COLON | SGE_RXSTATUS_NIBON | SGE_RXSTATUS_OVRUN | \
+	 SGE_RXSTATUS_MIIER | SGE_RXSTATUS_LIMIT | SGE_RXSTATUS_SHORT | \
+	 SGE_RXSTATUS_ABORT)
+
+/* Offload capabilities, published in DS under "sge<instance>.caps" */
+#define SGE_CAPS_KEY		"sge%d.caps"
+#define SGE_CAP_TXCSUM		(1 << 0) /* IPv4, TCP and UDP checksum insertion */
+#define SGE_CAP_RXCSUM		(1 << 1) /* Replies carry SGE_DL_CSUM_OK */
+#define SGE_CAP_VLAN		(1 << 2) /* Native VLAN tagged/stripped by card */
+#define SGE_CAP_RXSTAMP		(1 << 3) /* Replies carry SGE_DL_RXSTAMP */
+
+/* DL_TASK_REPLY flag: IP and TCP/UDP checksums verified by the card */
+#define SGE_DL_CSUM_OK		0x100
+
+/* DL_TASK_REPLY flag: a 64-bit TSC of first sight follows the frame */
+#define SGE_DL_RXSTAMP		0x200
+
+/* Frame parsing */
+#define SGE_ETHERTYPE_IP		0x0800
+#define SGE_ETHERTYPE_VLAN		0x8100
+#define SGE_IPPROTO_TCP		6
+#define SGE_IPPROTO_UDP		17
 
 /* Interrupts */
 #define	SGE_INTR_SOFT		0x40000000
@@ -145,6 +317,9 @@
 	(SGE_INTR_RX_IDLE | SGE_INTR_RX_DONE | SGE_INTR_TXQ1_IDLE | \
 	 SGE_INTR_TXQ1_DONE |SGE_INTR_TX_IDLE | SGE_INTR_TX_DONE | \
 	 SGE_INTR_TX_HALT | SGE_INTR_RX_HALT)
+/* Aggregated ports also follow the link, to fail over at once. */
+#define	SGE_INTR_MASK(e) \
+	((e)->lag_hash ? (SGE_INTRS | SGE_INTR_LINK) : SGE_INTRS)
 
 /* EEPROM Addresses */
 #define	SGE_EEPADDR_SIG		0x00 /* Signature */
@@ -180,6 +355,9 @@
 #define SGE_MIICTRL_ISOLATE		0x0400
 #define SGE_MIICTRL_AUTO		0x1000
 #define SGE_MIICTRL_RESET		0x8000
+#define SGE_MIICTRL_FDX		0x0100
+#define SGE_MIICTRL_SPEED100		0x2000
+#define SGE_MIICTRL_LOOPBACK		0x4000
 
 #define SGE_MII_DATA		0xffff0000
 #define SGE_MII_DATA_SHIFT		16
@@ -191,6 +369,23 @@
 #define SGE_MIIAUTON_TX		0x0080
 #define SGE_MIIAUTON_TX_FULL		0x0100
 #define SGE_MIIAUTON_T_FULL		0x0040
+#define SGE_MIIAUTON_PAUSE		0x0400
+#define SGE_MIIAUTON_ASM_DIR		0x0800
+
+/* Link aggregation over this port and the next: lag=<hash layers> */
+#define SGE_LAG_OFF		0
+#define SGE_LAG_L2		2 /* MAC addresses */
+#define SGE_LAG_L3		3 /* ...and IPv4 addresses */
+#define SGE_LAG_L4		4 /* ...and TCP/UDP ports */
+
+/* 802.3x flow control: fc=<0 off, 1 symmetric, 2 send only, 3 both> */
+#define SGE_FC_OFF		0
+#define SGE_FC_SYM		1
+#define SGE_FC_ASYM		2
+#define SGE_FC_BOTH		3
+#define SGE_ETHERTYPE_MAC_CTL		0x8808
+#define SGE_PAUSE_OPCODE		0x0001
+#define SGE_PAUSE_QUANTA		0xffff
 
 /* TX/RX Descriptor */
 typedef struct sge_desc
@@ -202,6 +397,195 @@ typedef struct sge_desc
 }
 sge_desc_t;
 
+/* Rate sampling */
+#define SGE_SAMPLE_MS		1000 /* Default sampling period */
+#define SGE_POLL_MS		1000 /* Watchdog and late negotiation poll */
+#define SGE_RATE_WEIGHT		2 /* EWMA weight, 1/(2^n) per sample */
+#define SGE_RATE_SHIFT		8 /* Fixed point fraction bits */
+
+#define SGE_RATE_RX_PPS		0
+#define SGE_RATE_RX_BPS		1
+#define SGE_RATE_RX_INTR		2
+#define SGE_RATE_RX_COPY		3
+#define SGE_RATE_TX_PPS		4
+#define SGE_RATE_TX_BPS		5
+#define SGE_RATE_TX_INTR		6
+#define SGE_RATE_TX_COPY		7
+#define SGE_RATE_NR		8
+
+/* Driver counters */
+typedef struct sge_stats
+{
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t rx_intrs;
+	uint64_t rx_copy_bytes;
+	uint64_t rx_staged;
+	uint64_t rxq_full;
+	uint64_t rx_errors;
+	uint64_t rx_crc;
+	uint64_t rx_abort;
+	uint64_t rx_short;
+	uint64_t rx_limit;
+	uint64_t rx_miier;
+	uint64_t rx_overrun;
+	uint64_t rx_frame;
+	uint64_t rx_csum_ok;
+	uint64_t rx_ipcsum_bad;
+	uint64_t rx_l4csum_bad;
+	uint64_t rx_vlan_drop;
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t tx_intrs;
+	uint64_t tx_copy_bytes;
+	uint64_t tx_done;
+	uint64_t tx_lost;
+	uint64_t tx_halts;
+	uint64_t tx_timeouts;
+	uint64_t rx_halts;
+	uint64_t tx_backlogged;
+	uint64_t tx_held;
+	uint64_t tx_prio_packets;
+	uint64_t tx_prio_done;
+	uint64_t tx_prio_backlogged;
+	uint64_t tx_pause;
+	uint64_t rx_pause;
+	uint64_t rx_stamp_short;
+	uint64_t rx_lu_drop;
+}
+sge_stats_t;
+
+/*
+ * Statistics page. Published read-only to any process through a direct
+ * grant whose id is stored in DS under "sge<instance>.stats". The driver
+ * bumps seq_tail before and seq_head after each update; a reader copies
+ * the page in one go and accepts the snapshot only if both are equal.
+ */
+#define SGE_STATPAGE_MAGIC	0x53474532 /* "SGE2" */
+#define SGE_STATPAGE_KEY	"sge%d.stats"
+
+typedef struct sge_statpage
+{
+	volatile uint32_t seq_head;
+	uint32_t magic;
+	uint32_t hz;
+	uint32_t updated;	/* Uptime in ticks */
+	sge_stats_t stats;
+	uint64_t rates[SGE_RATE_NR];	/* Fixed point, SGE_RATE_SHIFT */
+	uint64_t rx_dwell[SGE_PCT_NR];	/* Nanoseconds, SGE_PCT_* */
+	volatile uint32_t seq_tail;
+}
+sge_statpage_t;
+
+/*
+ * Capture ring. Sampled frame heads are stored as pcap records in a
+ * region granted read-only to any process, with the grant id in DS under
+ * "sge<instance>.capture". Slots have a fixed size, so the ring itself is
+ * not a pcap stream: a reader writes the embedded file header, then for
+ * each slot from (head - slots) up to head its record header less seq
+ * and caplen bytes, dropping the padding. A slot is stable when its seq
+ * equals the record number plus one before and after the copy; zero
+ * means the driver is writing it. Timestamps are seconds since the
+ * epoch.
+ */
+#define SGE_CAPTURE_KEY		"sge%d.capture"
+#define SGE_CAPTURE_SLOTS		64
+#define SGE_CAPTURE_SNAPLEN		128
+#define SGE_PCAP_MAGIC		0xa1b2c3d4
+#define SGE_PCAP_LINKTYPE		1 /* Ethernet */
+
+typedef struct sge_pcap_hdr
+{
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+}
+sge_pcap_hdr_t;
+
+typedef struct sge_pcap_rec
+{
+	volatile uint32_t seq;	/* Record number plus one, 0 while written */
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t caplen;
+	uint32_t len;
+}
+sge_pcap_rec_t;
+
+typedef struct sge_capring
+{
+	volatile uint32_t head;	/* Records written so far */
+	uint32_t slots;
+	uint32_t slot_size;	/* Seq, record header and snaplen */
+	uint32_t rate;		/* One in rate frames is captured */
+	sge_pcap_hdr_t pcap;
+	/* Followed by slots * slot_size bytes of records. */
+}
+sge_capring_t;
+
+/*
+ * Live update: once drained, the old instance saves this to DS under
+ * "sge<instance>.lu", and the new one picks up the card from it without
+ * a reset or renegotiation.
+ */
+#define SGE_LU_KEY		"sge%d.lu"
+#define SGE_LU_MAGIC		0x53474555 /* "SGEU" */
+
+typedef struct sge_lu_state
+{
+	uint32_t magic;
+	uint32_t size;		/* Catches layout changes between versions */
+	int status;
+	int flags;
+	int client;
+	message rx_message;	/* Pending read, its grants still valid */
+	ether_addr_t address;
+	int phy_addr;
+	uint16_t phy_id0;
+	uint16_t phy_id1;
+	int link_speed;
+	int duplex_mode;
+	int autoneg_done;
+	sge_stats_t stats;
+}
+sge_lu_state_t;
+
+/*
+ * Crash restart: what discovery and negotiation found, kept in DS under
+ * "sge<instance>.ckpt" so a restarted instance can skip both.
+ */
+#define SGE_CKPT_KEY		"sge%d.ckpt"
+#define SGE_CKPT_MAGIC		0x53474543 /* "SGEC" */
+
+typedef struct sge_ckpt
+{
+	uint32_t magic;
+	ether_addr_t address;
+	int rgmii;
+	int phy_addr;
+	uint16_t phy_id0;
+	uint16_t phy_id1;
+	int link_speed;
+	int duplex_mode;
+}
+sge_ckpt_t;
+
+/* Per-model defaults for PCI and DMA tuning */
+typedef struct sge_tune
+{
+	int model;		/* 0 ends the table */
+	int cls;		/* Cache line size in bytes, 0 leaves it */
+	int latency;		/* Latency timer, 0 leaves it */
+	int mwi;		/* Memory Write and Invalidate */
+	int tx_ctl;		/* DMA control words written at reset */
+	int rx_ctl;
+}
+sge_tune_t;
+
 typedef struct sge
 {
 	char name[8];
@@ -214,6 +598,13 @@ typedef struct sge
 	u8_t *regs;
 	ether_addr_t address;
 
+	int devind;		/* PCI device, for config space */
+	int pci_cls;		/* Bus tuning, -1 until probe picks the */
+	int pci_latency;	/* model default; see sge_tune_t */
+	int pci_mwi;
+	int dma_tx_ctl;
+	int dma_rx_ctl;
+
 	struct mii_phy *mii;
 	struct mii_phy *first_mii;
 	uint32_t cur_phy;
@@ -224,24 +615,152 @@ typedef struct sge
 
 	uint32_t cur_rx;
 	uint32_t cur_tx;
+	uint32_t dirty_tx;	/* Oldest descriptor not yet reclaimed */
+	uint32_t tx_inuse;	/* Descriptors owned by the card */
+	uint64_t tx_wd_done;	/* tx_done at the last watchdog poll */
+	int tx_wd_polls;
+
+	/* DMA arena: RX ring, TX ring, RX buffers, TX buffers. */
+	char *arena;
+	phys_bytes arena_p;
+	size_t arena_size;
+	uint32_t rx_desc_nr;
+	uint32_t tx_desc_nr;
 
 	sge_desc_t *rx_desc;
 	phys_bytes rx_desc_p;
 	char *rx_buffer;
 	phys_bytes rx_buffer_p;
 
+	char *rxq_buf;		/* Software RX queue */
+	uint16_t *rxq_len;
+	uint32_t *rxq_status;
+	uint64_t *rxq_stamp;
+	uint32_t rxq_depth;
+	uint32_t rxq_head;	/* Next frame to deliver */
+	uint32_t rxq_tail;	/* Next free slot */
+	uint32_t rxq_max;
+
 	sge_desc_t *tx_desc;
 	phys_bytes tx_desc_p;
 	char *tx_buffer;
 	phys_bytes tx_buffer_p;
 
+	char *txq_buf;		/* Software TX backlog */
+	uint16_t *txq_len;
+	uint32_t txq_depth;
+	uint32_t txq_head;	/* Next frame to submit */
+	uint32_t txq_tail;	/* Next free slot */
+	uint32_t txq_max;
+
+	int dwell_on;		/* Stamp RX frames and keep dwell times */
+	uint64_t rx_seen;	/* First sight of sge_rx_next()'s frame */
+	uint64_t *rx_stamps;	/* TSC at first sight, per RX descriptor */
+	uint32_t rx_stamped;	/* Descriptors from cur_rx with a stamp */
+	uint64_t dwell[SGE_DWELL_NR];	/* Last dwell times, in cycles */
+	uint64_t dwell_tmp[SGE_DWELL_NR];
+	uint32_t dwell_idx;
+	uint64_t dwell_pct[SGE_PCT_NR];	/* Nanoseconds, SGE_PCT_* */
+
+	int pipeline;		/* Service rings before client copies */
+
+	struct sge *peer;	/* Second port of the aggregate, if any */
+	int lag_peer;		/* This is that second port */
+	int lag_hash;		/* SGE_LAG_* */
+	int link_up;		/* As last seen, while aggregated */
+	char *tx_stage;		/* Frame being classified or hashed to a port */
+	size_t tx_staged;	/* Its length; 0 until copied from the client */
+
+	int fc_mode;		/* SGE_FC_*, as configured */
+	int fc_tx;		/* Negotiated: we may send PAUSE */
+	int fc_rx;		/* Negotiated: we honour PAUSE */
+	int fc_xoff;		/* Our XOFF is in effect at the partner */
+	uint64_t fc_refresh;	/* TSC to send it again by */
+	int fc_paused;		/* Partner asked us to hold off... */
+	uint64_t fc_resume;	/* ...until this TSC */
+
+	int prio_on;		/* Priority lane, if any classifier is set */
+	uint32_t prio_type;	/* EtherType, 0 for none */
+	uint32_t prio_dscp;	/* Lowest IPv4 DSCP, 0 for none */
+	uint32_t prio_size;	/* Largest frame, 0 for none */
+	uint32_t prio_reserve;
+	uint8_t *tx_prio;	/* Per descriptor: frame was priority */
+	char *prioq_buf;	/* Priority backlog, drained first */
+	uint16_t prioq_len[SGE_PRIOQ_NR];
+	uint32_t prioq_head;
+	uint32_t prioq_tail;
+
 	int client;
 	message rx_message;
 	message tx_message;
 	size_t rx_size;
+	int rx_csum_ok;
+	int rx_stamp_ok;
+
+	/* I/O vectors of the pending requests, fetched once per request. */
+	iovec_s_t rx_iovec[SGE_IOVEC_NR];
+	iovec_s_t tx_iovec[SGE_IOVEC_NR];
+	int rx_iovec_valid;
+	int tx_iovec_valid;
 
 	int RGMII;
 	int MAC_APC;
+
+	uint32_t caps;		/* SGE_CAP_* in use */
+
+	uint16_t vlan_pvid;	/* Inserted on TX, stripped on RX; 0 if none */
+	int vlan_filter;	/* Drop VLANs not in vlan_map */
+	uint32_t vlan_map[4096 / 32];
+
+	sge_stats_t stats;
+
+	clock_t sample_ticks;
+	clock_t sample_last;
+	clock_t poll_ticks;	/* Housekeeping, run even without sampling */
+	clock_t poll_last;
+	uint64_t rate_prev[SGE_RATE_NR];
+	uint64_t rate_avg[SGE_RATE_NR]; /* Per second, fixed point */
+
+	int pg_active;		/* Packet generator owns the TX ring */
+	uint32_t pg_count;	/* Configured frames per run */
+	uint32_t pg_target;	/* This run, cut short by a second press */
+	uint32_t pg_size;
+	uint32_t pg_rate;	/* Frames per second, 0 for line rate */
+	uint32_t pg_posted;
+	uint64_t pg_done_base;
+	uint64_t pg_start;	/* TSC at the first frame */
+	uint64_t pg_last;	/* TSC at the last completion seen */
+	uint64_t pg_pps;	/* Result of the last run */
+	uint64_t pg_bps;
+
+	int selftest_nr;	/* Loopback frames to bounce at start */
+	int restarted;		/* Try the DS checkpoint before probing */
+
+	int dump_step;		/* SGE_DUMP_* section to print next */
+	int dump_idx;
+	uint32_t dump_regs[SGE_REG_NR];
+	uint16_t dump_phy[SGE_DUMP_PHY_NR];
+	uint16_t eeprom[SGE_DUMP_EEPROM_NR];	/* Cached, never changes */
+	int eeprom_nr;
+
+	sge_statpage_t *statpage;
+	cp_grant_id_t statpage_grant;
+
+#if SGE_CAPTURE
+	sge_capring_t *cap_ring;
+	size_t cap_size;
+	cp_grant_id_t cap_grant;
+	uint32_t cap_skip;
+	uint64_t cap_tsc;	/* Cycle counter at cap_sec/cap_usec */
+	uint64_t cap_sec;
+	uint32_t cap_usec;
+#endif
+
+#if SGE_MMIO_STATS
+	int mmio_ctx;		/* SGE_CTX_*, only sge_state's is used */
+	uint32_t mmio_rd[SGE_CTX_NR][SGE_REG_NR];
+	uint32_t mmio_wr[SGE_CTX_NR][SGE_REG_NR];
+#endif
 }
 sge_t;
 